@@ -0,0 +1,191 @@
+/*
+ * cache_bench.c: measures how long a cache hit takes as the number of cached
+ * files grows, to check that it does not grow with it.
+ *
+ * To build and run:
+ *  gcc -O2 -D_GNU_SOURCE -o cache_bench cache_bench.c request.c common.c \
+ *      -lpthread -lm
+ *  cache_bench [-p policy] [-s nr_shards] [-n max_files] [-h nr_hits]
+ *
+ * The cache is filled in steps of 1000, 3000, 10000, ... files up to
+ * max_files (default 100000), and after each step nr_hits (default 2000000)
+ * requests for randomly chosen cached files are timed, once over all of them
+ * and once over the first 1000 only. The second stays within the CPU caches,
+ * so if it grows with the number of files, the cache's data structures do
+ * not scale. The first also shows the cost of cache misses, which grows with
+ * the memory the files take up whatever the data structures. A hit goes through
+ * the same steps as in do_server_request(): hashing the name, the lock-free
+ * lookup, pinning the file, recording the hit with the policy and unpinning
+ * it. Nothing is sent, so the network does not hide the cost of a hit.
+ *
+ * server_thread.c is included rather than linked, to reach its static
+ * functions.
+ */
+
+#include "server_thread.c"
+
+#define BENCH_FILE_SIZE 64
+#define BENCH_HOT_FILES 1000
+
+static char *
+bench_name(int i)
+{
+	char name[32], *p;
+
+	snprintf(name, sizeof(name), "./bench/%07d", i);
+	p = strdup(name);
+	assert(p);
+	return p;
+}
+
+/* cache the files from from to nr_files - 1 */
+static void
+bench_fill(struct cache *cache, char **names, int from, int nr_files)
+{
+	int i;
+
+	for (i = from; i < nr_files; i++) {
+		struct file_data *data = file_data_init();
+		struct cache_shard *shard;
+		struct file *file;
+		unsigned long hash;
+		bool cached;
+
+		data->file_name = strdup(names[i]);
+		assert(data->file_name);
+		data->file_size = BENCH_FILE_SIZE;
+		data->file_buf = slab_alloc(BENCH_FILE_SIZE);
+		memset(data->file_buf, 'a' + i % 26, BENCH_FILE_SIZE);
+		request_prepare_checked(data, ('a' + i % 26) * BENCH_FILE_SIZE);
+		hash = hashing(data->file_name);
+		shard = cache_shard(cache, hash);
+		file = file_new(hash, data, NULL);
+		pthread_mutex_lock(&shard->lock);
+		cached = cache_insert(cache, shard, file);
+		pthread_mutex_unlock(&shard->lock);
+		file_put(cache, file);
+		file_data_free(data);
+		if (!cached) {
+			fprintf(stderr, "cache_bench: %s was not cached\n",
+				names[i]);
+			exit(1);
+		}
+	}
+}
+
+/* returns the mean time of a hit on one of the first nr_files files, in
+ * nanoseconds */
+static double
+bench_hits(struct cache *cache, char **names, int nr_files, long nr_hits)
+{
+	struct timespec start, end;
+	unsigned long seed = 88172645463325252UL;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_hits; i++) {
+		struct cache_shard *shard;
+		struct file *file;
+		unsigned long hash;
+		char *name;
+
+		/* xorshift, so that hits land all over the table */
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		name = names[seed % nr_files];
+
+		hash = hashing(name);
+		shard = cache_shard(cache, hash);
+		epoch_enter(&cache->epoch);
+		file = cache_lookup(shard, hash, name);
+		if (file != NULL && !file_get(file)) {
+			file = NULL;
+		}
+		epoch_exit(&cache->epoch);
+		if (file == NULL) {
+			fprintf(stderr, "cache_bench: %s missed\n", name);
+			exit(1);
+		}
+		cache_hit(cache, shard, file);
+		file_put(cache, file);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) / nr_hits;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p policy] [-s nr_shards] [-n max_files] "
+		"[-h nr_hits]\n", program);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int steps[] = { 1000, 3000, 10000, 30000, 100000,
+				     300000, 1000000 };
+	struct server_options opts;
+	struct cache *cache;
+	int max_files = 100000;
+	long nr_hits = 2000000;
+	char **names;
+	int opt, i, filled = 0;
+
+	server_options_init(&opts);
+	opts.nr_shards = 1;
+	while ((opt = getopt(argc, argv, "p:s:n:h:")) != -1) {
+		switch (opt) {
+		case 'p':
+			opts.policy = optarg;
+			break;
+		case 's':
+			opts.nr_shards = atoi(optarg);
+			break;
+		case 'n':
+			max_files = atoi(optarg);
+			break;
+		case 'h':
+			nr_hits = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.nr_shards <= 0 || max_files <= 0 || nr_hits <= 0) {
+		usage(argv[0]);
+	}
+
+	names = Malloc(sizeof(char *) * max_files);
+	for (i = 0; i < max_files; i++) {
+		names[i] = bench_name(i);
+	}
+	/* room for all of them, below the reclaimer's high watermark */
+	cache = cache_init(1 << 30, opts.nr_shards, &opts);
+
+	printf("policy %s, %d shards\n", opts.policy, opts.nr_shards);
+	printf("%10s %12s %12s\n", "files", "ns per hit", "hot 1000");
+	for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])); i++) {
+		int n = steps[i] < max_files ? steps[i] : max_files;
+
+		bench_fill(cache, names, filled, n);
+		filled = n;
+		printf("%10d %12.1f %12.1f\n", n,
+		       bench_hits(cache, names, n, nr_hits),
+		       bench_hits(cache, names, n < BENCH_HOT_FILES ?
+				  n : BENCH_HOT_FILES, nr_hits));
+		if (n == max_files) {
+			break;
+		}
+	}
+
+	cache_destroy(cache);
+	for (i = 0; i < max_files; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "common.h"
+#include <sys/sendfile.h>
 
 /************************** 
  * Error-handling functions
@@ -103,6 +104,29 @@ rio_write(int fd, void *usrbuf, size_t n)
 	return n;
 }
 
+/* rio_sendfile - robustly copy n bytes from in_fd at offset to out_fd,
+ * without copying them through user space. returns fewer than n bytes only
+ * if the file is shorter than expected. */
+static ssize_t
+rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n)
+{
+	size_t nleft = n;
+	ssize_t nwritten;
+
+	while (nleft > 0) {
+		if ((nwritten = sendfile(out_fd, in_fd, &offset, nleft)) < 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				nwritten = 0;	/* and call sendfile() again */
+			else
+				return -1;	/* errorno set by sendfile() */
+		} else if (nwritten == 0) {
+			break;			/* EOF */
+		}
+		nleft -= nwritten;
+	}
+	return n - nleft;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -184,6 +208,26 @@ Rio_write(int fd, void *usrbuf, size_t n)
 		unix_error("Rio_writen error");
 }
 
+/* like Rio_write, for a usrbuf that maps a file. if the file was truncated
+ * since, the pages past its end can not be read, and write() fails with
+ * EFAULT. returns -1 then, and 0 once n bytes are written. */
+int
+Rio_write_mapped(int fd, void *usrbuf, size_t n)
+{
+	if (rio_write(fd, usrbuf, n) == n)
+		return 0;
+	if (errno != EFAULT)
+		unix_error("Rio_writen error");
+	return -1;
+}
+
+void
+Rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n)
+{
+	if (rio_sendfile(out_fd, in_fd, offset, n) < 0)
+		unix_error("Rio_sendfile error");
+}
+
 struct rio *
 Rio_init(int fd)
 {
@@ -72,6 +72,8 @@ struct rio *Rio_init(int fd);
 void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
+int Rio_write_mapped(int fd, void *usrbuf, size_t n);
+void Rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for client/server helper functions */
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <string.h>
@@ -114,6 +115,8 @@ main(int argc, const char *argv[])
 		double ms = default_file_sz;
 		unsigned int csum = 0;
 		int j;
+		struct stat statbuf;
+		char xattr_buf[128];
 
 		strcpy(filename, dir);
 		sprintf(name, "/%05d", nr_files++);
@@ -132,6 +135,14 @@ main(int argc, const char *argv[])
 			Rio_write(fd, buf, sz);
 			remaining -= sz;
 		}
+		/* record the checksum with the file, so that the server can
+		 * send it without reading it in. this fails quietly on file
+		 * systems that don't support user xattrs. */
+		SYS(fstat(fd, &statbuf));
+		sprintf(xattr_buf, "%u %lld %lld.%09ld", csum,
+			(long long)statbuf.st_size,
+			(long long)statbuf.st_mtim.tv_sec, statbuf.st_mtim.tv_nsec);
+		fsetxattr(fd, "user.csum", xattr_buf, strlen(xattr_buf), 0);
 		SYS(close(fd));
 		printf("filename = %s, csum = %u, len = %d\n", filename, csum,
 		       file_sz);
@@ -0,0 +1,270 @@
+/*
+ * mrc_bench.c: compares the miss ratio curve that -r estimates with the
+ * exact one, and measures what estimating it costs a request.
+ *
+ * To build and run:
+ *  gcc -O2 -D_GNU_SOURCE -o mrc_bench mrc_bench.c request.c common.c \
+ *      -lpthread -lm
+ *  mrc_bench [-n nr_files] [-r nr_requests] [-z alpha] [-t nr_threads]
+ *
+ * A trace of nr_requests (default 1000000) requests for nr_files (default
+ * 100000) files is drawn from a Zipf distribution of exponent alpha (default
+ * 0.9), with file sizes from a Pareto distribution of shape 1.2 and at least
+ * 2000 bytes. For each power of two from 64KB up to the size of all the
+ * files, the miss ratio of an LRU cache of that many bytes is simulated
+ * exactly and printed next to the estimate. Then nr_threads (default 1)
+ * threads each replay the trace through mrc_access() a few times, from
+ * different starting points, and the mean time per request is printed.
+ *
+ * server_thread.c is included rather than linked, to reach its static
+ * functions.
+ */
+
+#include "server_thread.c"
+
+#define BENCH_MIN_SIZE 2000
+#define BENCH_MAX_SIZE (1 << 24)
+#define BENCH_REPLAYS 5
+
+struct bench_trace {
+	int nr_files;
+	unsigned long *hashes;	/* by file */
+	int *sizes;
+	long nr_requests;
+	int *files;		/* by request */
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_trace *trace;
+	struct mrc *mrc;
+	long start;
+};
+
+static unsigned long bench_seed = 88172645463325252UL;
+
+/* xorshift */
+static unsigned long
+bench_random(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return bench_seed;
+}
+
+/* uniform in (0, 1] */
+static double
+bench_uniform(void)
+{
+	return ((bench_random() >> 11) + 1.0) / (1UL << 53);
+}
+
+static void
+bench_make_trace(struct bench_trace *t, int nr_files, long nr_requests,
+		 double alpha)
+{
+	double *cdf = Malloc(sizeof(double) * nr_files);
+	double sum = 0;
+	long i;
+
+	t->nr_files = nr_files;
+	t->hashes = Malloc(sizeof(unsigned long) * nr_files);
+	t->sizes = Malloc(sizeof(int) * nr_files);
+	for (i = 0; i < nr_files; i++) {
+		double size = BENCH_MIN_SIZE / pow(bench_uniform(), 1 / 1.2);
+
+		t->hashes[i] = bench_random();
+		t->sizes[i] = size < BENCH_MAX_SIZE ? size : BENCH_MAX_SIZE;
+		sum += 1 / pow(i + 1, alpha);
+		cdf[i] = sum;
+	}
+	t->nr_requests = nr_requests;
+	t->files = Malloc(sizeof(int) * nr_requests);
+	for (i = 0; i < nr_requests; i++) {
+		double u = bench_uniform() * sum;
+		int lo = 0, hi = nr_files - 1;
+
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		t->files[i] = lo;
+	}
+	free(cdf);
+}
+
+/* the miss ratio of an LRU cache of size bytes on the trace. files larger
+ * than the cache are never cached. */
+static double
+bench_exact(struct bench_trace *t, long size)
+{
+	/* a list of the cached files, most recent first, with nr_files as
+	 * its head */
+	int *prev = Malloc(sizeof(int) * (t->nr_files + 1));
+	int *next = Malloc(sizeof(int) * (t->nr_files + 1));
+	char *cached = calloc(t->nr_files, 1);
+	int head = t->nr_files;
+	long i, used = 0, misses = 0;
+
+	assert(cached);
+	prev[head] = next[head] = head;
+	for (i = 0; i < t->nr_requests; i++) {
+		int f = t->files[i];
+
+		if (cached[f]) {
+			next[prev[f]] = next[f];
+			prev[next[f]] = prev[f];
+		} else {
+			misses++;
+			if (t->sizes[f] > size) {
+				continue;
+			}
+			cached[f] = 1;
+			used += t->sizes[f];
+			while (used > size) {
+				int victim = prev[head];
+
+				next[prev[victim]] = head;
+				prev[head] = prev[victim];
+				cached[victim] = 0;
+				used -= t->sizes[victim];
+			}
+		}
+		prev[f] = head;
+		next[f] = next[head];
+		prev[next[head]] = f;
+		next[head] = f;
+	}
+	free(prev);
+	free(next);
+	free(cached);
+	return (double)misses / t->nr_requests;
+}
+
+static void *
+bench_replay(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct bench_trace *t = bt->trace;
+	long i, r;
+
+	for (r = 0; r < BENCH_REPLAYS; r++) {
+		for (i = 0; i < t->nr_requests; i++) {
+			int f = t->files[(bt->start + i) % t->nr_requests];
+
+			mrc_access(bt->mrc, t->hashes[f], t->sizes[f]);
+		}
+	}
+	return NULL;
+}
+
+/* returns the mean time per request, in nanoseconds, that nr_threads
+ * threads take to replay the trace through a new estimate */
+static double
+bench_cost(struct bench_trace *t, int nr_threads)
+{
+	struct bench_thread *bt = Malloc(sizeof(struct bench_thread) *
+					 nr_threads);
+	struct mrc *m = mrc_init();
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_threads; i++) {
+		bt[i].trace = t;
+		bt[i].mrc = m;
+		bt[i].start = t->nr_requests / nr_threads * i;
+		SYS(pthread_create(&bt[i].thread, NULL, bench_replay, &bt[i]));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(bt[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	mrc_destroy(m);
+	free(bt);
+	/* the threads run side by side, so this is per request served */
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) /
+		((double)BENCH_REPLAYS * t->nr_requests * nr_threads);
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n nr_files] [-r nr_requests] [-z alpha] "
+		"[-t nr_threads]\n", program);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_trace trace;
+	struct mrc_sum sum;
+	struct mrc *m;
+	int nr_files = 100000, nr_threads = 1;
+	long nr_requests = 1000000, total = 0, size, i;
+	double alpha = 0.9;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:z:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_files = atoi(optarg);
+			break;
+		case 'r':
+			nr_requests = atol(optarg);
+			break;
+		case 'z':
+			alpha = atof(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_files <= 0 || nr_requests <= 0 || alpha <= 0 ||
+	    nr_threads <= 0) {
+		usage(argv[0]);
+	}
+
+	bench_make_trace(&trace, nr_files, nr_requests, alpha);
+	m = mrc_init();
+	for (i = 0; i < nr_requests; i++) {
+		int f = trace.files[i];
+
+		mrc_access(m, trace.hashes[f], trace.sizes[f]);
+	}
+	mrc_add_up(m, &sum);
+	for (i = 0; i < nr_files; i++) {
+		total += trace.sizes[i];
+	}
+	printf("%d files, %ld bytes, %ld requests, zipf %.2f, 1 in %lu to "
+	       "%lu files sampled\n", nr_files, total, nr_requests, alpha,
+	       sum.min_rate, sum.max_rate);
+	printf("%12s %10s %10s %10s\n", "cache bytes", "exact", "estimate",
+	       "error");
+	for (size = 1 << 16; size < 2 * total; size *= 2) {
+		double exact = bench_exact(&trace, size);
+		double estimate = mrc_miss_ratio(&sum, size);
+
+		printf("%12ld %10.4f %10.4f %+10.4f\n", size, exact, estimate,
+		       estimate - exact);
+	}
+	mrc_destroy(m);
+
+	printf("%d threads: %.1f ns per request\n", nr_threads,
+	       bench_cost(&trace, nr_threads));
+	free(trace.hashes);
+	free(trace.sizes);
+	free(trace.files);
+	return 0;
+}
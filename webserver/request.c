@@ -4,12 +4,42 @@
 
 #include "common.h"
 #include "request.h"
+#include <sys/xattr.h>
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	char *accept_encoding; /* Accept-Encoding header value, or NULL */
+	int stat_valid;	 /* request_openfile() left its stat() in sbuf */
+	struct stat sbuf;
 };
 
+/* allocator for the buffers that files are read into */
+static void *(*request_alloc)(size_t size) = Malloc;
+static void (*request_dealloc)(void *ptr) = free;
+
+/* use alloc and dealloc for file buffers from now on. must be called before
+ * any request is served. */
+void
+request_set_allocator(void *(*alloc)(size_t size), void (*dealloc)(void *ptr))
+{
+	request_alloc = alloc;
+	request_dealloc = dealloc;
+}
+
+/* free the buffer that data was read or mapped into */
+void
+request_free_buf(struct file_data *data)
+{
+	if (data->file_mapped) {
+		SYS(munmap(data->file_buf, data->file_size));
+	} else if (data->file_buf) {
+		request_dealloc(data->file_buf);
+	}
+	data->file_buf = NULL;
+	data->file_mapped = 0;
+}
+
 /* requestError(fd, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
@@ -54,14 +84,21 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 
 }
 
-/* reads and discards everything up to an empty text line */
+/* reads everything up to an empty text line, keeping only the
+ * Accept-Encoding header */
 static void
-request_read_headers(struct rio *rp)
+request_read_headers(struct request *rq, struct rio *rp)
 {
 	char buf[MAXLINE];
+	static const char accept[] = "Accept-Encoding:";
 
 	Rio_readlineb(rp, buf, MAXLINE);
 	while (strcmp(buf, "\r\n")) {
+		if (strncasecmp(buf, accept, sizeof(accept) - 1) == 0 &&
+		    rq->accept_encoding == NULL) {
+			rq->accept_encoding = strdup(buf + sizeof(accept) - 1);
+			assert(rq->accept_encoding);
+		}
 		Rio_readlineb(rp, buf, MAXLINE);
 	}
 	return;
@@ -76,23 +113,23 @@ request_read_headers(struct rio *rp)
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
 static void
-request_parse_URI(char *uri, char *filename, size_t max)
+request_parse_URI(const char *uri, char *filename, size_t max)
 {
 	snprintf(filename, max, "./%s", uri);
 }
 
-/* Fills in the filetype given the filename */
-static void
-request_get_file_type(char *filename, char *filetype)
+/* Returns the filetype given the filename */
+static const char *
+request_get_file_type(char *filename)
 {
 	if (strstr(filename, ".html"))
-		strcpy(filetype, "text/html");
+		return "text/html";
 	else if (strstr(filename, ".gif"))
-		strcpy(filetype, "image/gif");
+		return "image/gif";
 	else if (strstr(filename, ".jpg"))
-		strcpy(filetype, "image/jpeg");
+		return "image/jpeg";
 	else
-		strcpy(filetype, "text/plain");
+		return "text/plain";
 }
 
 /* entry point to this file */
@@ -111,9 +148,20 @@ request_init(int connfd, struct file_data *data)
 	rq = Malloc(sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
+	rq->accept_encoding = NULL;
+	rq->stat_valid = 0;
 	data->file_name = Malloc(MAXLINE);
 	data->file_buf = NULL;
 	data->file_size = 0;
+	data->file_fd = -1;
+	data->file_fd_entry = NULL;
+	data->file_mapped = 0;
+	data->header = NULL;
+	data->header_size = 0;
+	data->file_zbuf = NULL;
+	data->file_zsize = 0;
+	data->zheader = NULL;
+	data->zheader_size = 0;
 	rio = Rio_init(rq->fd);
 	Rio_readlineb(rio, buf, MAXLINE);
 	sscanf(buf, "%s %s %s", method, uri, version);
@@ -126,7 +174,7 @@ request_init(int connfd, struct file_data *data)
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
+	request_read_headers(rq, rio);
 	request_parse_URI(uri, data->file_name, MAXLINE);
 	Rio_destroy(rio);
 	return rq;
@@ -138,66 +186,788 @@ request_destroy(struct request *rq)
 	assert(rq);
 	/* close the connection fd */
 	SYS(close(rq->fd));
+	free(rq->accept_encoding);
 	free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+/* did the client list coding in its Accept-Encoding header, and not with
+ * q=0? */
 int
-request_readfile(struct request *rq)
+request_accepts_encoding(struct request *rq, const char *coding)
 {
-	int srcfd;
-	struct stat sbuf;
-	struct file_data *data;
-	char *ext;
+	char *p = rq->accept_encoding;
+	size_t len = strlen(coding);
 
-	data = rq->data;
-	assert(data);
+	while (p && *p) {
+		p += strspn(p, " \t,");
+		/* also matches at the end of the string */
+		if (strncasecmp(p, coding, len) == 0 &&
+		    strchr(" \t;,\r\n", p[len])) {
+			p += len + strspn(p + len, " \t");
+			if (*p != ';') {
+				return 1;
+			}
+			/* parameters, only q matters */
+			p += 1 + strspn(p + 1, " \t");
+			return !(strncasecmp(p, "q=0", 3) == 0 &&
+				 strspn(p + 3, ".0") ==
+				 strcspn(p + 3, " \t,\r\n"));
+		}
+		p = strchr(p, ',');
+	}
+	return 0;
+}
+
+/* Returns why filename may not be served, or NULL if it may. */
+static char *
+request_forbidden(const char *filename)
+{
+	char *ext;
 
 	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
+	if (filename[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
-		return 0;
+		return "OS Web Server doesn't serve files with absolute paths";
 	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
-		return 0;
+	if (strstr(filename, "..") != NULL) {
+		return "OS Web Server doesn't serve files with .. in the path";
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
+	if (((ext = strrchr(filename, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+		return "OS Web Server doesn't serve C or header files ";
+	}
+	return NULL;
+}
+
+/* the stat cache. it remembers for a short while what stat() said about
+ * recently requested files: their stat results, or that they could not be
+ * found or read, so that repeated requests for missing files are answered
+ * without a syscall. entries expire ttl after they were added. it is split
+ * into stripes, each with its own lock and an equal share of the entries,
+ * and when a stripe is full its oldest entry makes room. entries are kept
+ * in the order they were added, which is also the order they expire in. */
+#define STAT_STRIPES 16
+#define STAT_STRIPE_BUCKETS 512	/* power of 2 */
+
+#define STAT_FOUND 0		/* an entry's status when stat() succeeded */
+
+struct stat_entry {
+	char *name;
+	unsigned long hash;
+	int status;		/* STAT_FOUND, or the error sent, 403 or 404 */
+	struct stat sbuf;	/* if STAT_FOUND */
+	long long expires;	/* in stat_now() time */
+	struct stat_entry *hnext;	/* next in the hash chain */
+	struct stat_entry *next;	/* next added */
+};
+
+struct stat_stripe {
+	pthread_mutex_t lock;
+	struct stat_entry *table[STAT_STRIPE_BUCKETS];
+	struct stat_entry *oldest;
+	struct stat_entry *newest;
+	int nr_entries;
+	long hits;
+	long negative_hits;
+	long misses;
+} __attribute__((aligned(64)));
+
+static struct stat_stripe *stat_stripes;	/* NULL if disabled */
+static int stat_stripe_size;			/* entries per stripe */
+static long long stat_ttl;			/* nanoseconds */
+
+/* cache stat results for ttl_ms milliseconds, in up to nr_entries entries.
+ * must be called before any request is served. */
+void
+request_set_stat_cache(int nr_entries, long ttl_ms)
+{
+	int i;
+
+	stat_stripes = aligned_alloc(64, sizeof(struct stat_stripe) *
+				     STAT_STRIPES);
+	assert(stat_stripes);
+	memset(stat_stripes, 0, sizeof(struct stat_stripe) * STAT_STRIPES);
+	for (i = 0; i < STAT_STRIPES; i++) {
+		pthread_mutex_init(&stat_stripes[i].lock, NULL);
+	}
+	stat_stripe_size = (nr_entries + STAT_STRIPES - 1) / STAT_STRIPES;
+	stat_ttl = ttl_ms * 1000000LL;
+}
+
+static long long
+stat_now(void)
+{
+	struct timespec ts;
+
+	/* served from the vDSO, it is not a syscall */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long
+stat_hash(const char *name)
+{
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name++) * 1099511628211UL;
+	}
+	/* the last bytes barely reach the high bits that pick a stripe, and
+	 * names often differ only there */
+	hash ^= hash >> 29;
+	return hash * 0x9e3779b97f4a7c15UL;
+}
+
+static struct stat_stripe *
+stat_stripe(unsigned long hash)
+{
+	return &stat_stripes[(hash >> 32) % STAT_STRIPES];
+}
+
+/* the caller holds s->lock */
+static struct stat_entry **
+stat_find(struct stat_stripe *s, unsigned long hash, const char *name)
+{
+	struct stat_entry **pp;
+
+	for (pp = &s->table[hash % STAT_STRIPE_BUCKETS]; *pp;
+	     pp = &(*pp)->hnext) {
+		if ((*pp)->hash == hash && strcmp((*pp)->name, name) == 0) {
+			break;
+		}
+	}
+	return pp;
+}
+
+/* the caller holds s->lock */
+static void
+stat_drop_oldest(struct stat_stripe *s)
+{
+	struct stat_entry *e = s->oldest;
+
+	*stat_find(s, e->hash, e->name) = e->hnext;
+	s->oldest = e->next;
+	if (s->oldest == NULL) {
+		s->newest = NULL;
+	}
+	s->nr_entries--;
+	free(e->name);
+	free(e);
+}
+
+/* look name up in the stat cache. returns its status and fills sbuf if it
+ * was found, or returns -1 if it is not cached. */
+static int
+stat_cache_lookup(const char *name, struct stat *sbuf)
+{
+	unsigned long hash = stat_hash(name);
+	struct stat_stripe *s = stat_stripe(hash);
+	struct stat_entry *e;
+	int status = -1;
+
+	pthread_mutex_lock(&s->lock);
+	e = *stat_find(s, hash, name);
+	if (e != NULL && e->expires > stat_now()) {
+		status = e->status;
+		if (status == STAT_FOUND) {
+			*sbuf = e->sbuf;
+			s->hits++;
+		} else {
+			s->negative_hits++;
+		}
+	} else {
+		s->misses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return status;
+}
+
+/* remember what stat() said about name, with sbuf if status is
+ * STAT_FOUND */
+static void
+stat_cache_add(const char *name, int status, struct stat *sbuf)
+{
+	unsigned long hash = stat_hash(name);
+	struct stat_stripe *s = stat_stripe(hash);
+	struct stat_entry *e, **pp;
+	long long now = stat_now();
+
+	pthread_mutex_lock(&s->lock);
+	while (s->oldest && (s->oldest->expires <= now ||
+			     s->nr_entries >= stat_stripe_size)) {
+		stat_drop_oldest(s);
+	}
+	pp = stat_find(s, hash, name);
+	if (*pp != NULL) {
+		/* update it, but keep it in expiry order */
+		(*pp)->status = status;
+		if (status == STAT_FOUND) {
+			(*pp)->sbuf = *sbuf;
+		}
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	e = Malloc(sizeof(struct stat_entry));
+	e->name = strdup(name);
+	assert(e->name);
+	e->hash = hash;
+	e->status = status;
+	if (status == STAT_FOUND) {
+		e->sbuf = *sbuf;
+	}
+	e->expires = now + stat_ttl;
+	e->hnext = NULL;
+	*pp = e;
+	e->next = NULL;
+	if (s->newest) {
+		s->newest->next = e;
+	} else {
+		s->oldest = e;
+	}
+	s->newest = e;
+	s->nr_entries++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* forget what the stat cache knows about the files whose names start with
+ * the len bytes at prefix, because they changed. with the terminating NUL
+ * included in len, it is a single file. */
+void
+request_forget_stat(const char *prefix, size_t len)
+{
+	struct stat_entry **pp, *e;
+	struct stat_stripe *s;
+	int i;
+
+	for (i = 0; stat_stripes && i < STAT_STRIPES; i++) {
+		s = &stat_stripes[i];
+		pthread_mutex_lock(&s->lock);
+		for (e = s->oldest; e; e = e->next) {
+			if (strncmp(e->name, prefix, len) == 0) {
+				/* expires it, it goes when it is the oldest */
+				e->expires = 0;
+			}
+		}
+		/* but gone from lookups now */
+		for (pp = &s->oldest; (e = *pp) != NULL;) {
+			if (e->expires == 0) {
+				*stat_find(s, e->hash, e->name) = e->hnext;
+				*pp = e->next;
+				s->nr_entries--;
+				free(e->name);
+				free(e);
+			} else {
+				s->newest = e;
+				pp = &e->next;
+			}
+		}
+		if (s->oldest == NULL) {
+			s->newest = NULL;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void
+request_print_stat_stats(FILE *out)
+{
+	long hits = 0, negative_hits = 0, misses = 0, nr_entries = 0;
+	int i;
+
+	if (stat_stripes == NULL) {
+		return;
+	}
+	for (i = 0; i < STAT_STRIPES; i++) {
+		pthread_mutex_lock(&stat_stripes[i].lock);
+		hits += stat_stripes[i].hits;
+		negative_hits += stat_stripes[i].negative_hits;
+		misses += stat_stripes[i].misses;
+		nr_entries += stat_stripes[i].nr_entries;
+		pthread_mutex_unlock(&stat_stripes[i].lock);
+	}
+	fprintf(out, "stat cache: %ld entries, %ld hits, %ld negative hits, "
+		"%ld misses\n", nr_entries, hits, negative_hits, misses);
+}
+
+/* check that filename corresponding to request may be served, and stat it.
+ * if cached is not NULL, the result may come from the stat cache, and then
+ * *cached is set. the caller must be ready for such a result to be stale.
+ * Returns 1 on success, and fills sbuf.
+ * Returns 0 on failure, sends error to client. */
+static int
+request_statfile(struct request *rq, struct stat *sbuf, int *cached)
+{
+	struct file_data *data;
+	char *why;
+	int status = -1;
+
+	data = rq->data;
+	assert(data);
+	if (cached) {
+		*cached = 0;
+	}
+	if (rq->stat_valid) {
+		/* request_openfile() just stat'ed it, as freshly as we
+		 * would */
+		*sbuf = rq->sbuf;
+		rq->stat_valid = 0;
+		return 1;
+	}
+
+	why = request_forbidden(data->file_name);
+	if (why != NULL) {
+		request_error(rq->fd, data->file_name, "404", "Not found", why);
 		return 0;
 	}
 
-	if (stat(data->file_name, &sbuf) < 0) {
+	if (stat_stripes) {
+		status = stat_cache_lookup(data->file_name, sbuf);
+	}
+	if (status == STAT_FOUND && cached) {
+		*cached = 1;
+		return 1;
+	}
+	if (status == STAT_FOUND) {
+		/* the caller needs an up to date result */
+		status = -1;
+	}
+	if (status < 0) {
+		if (stat(data->file_name, sbuf) < 0) {
+			status = 404;
+		} else if (!(S_ISREG(sbuf->st_mode)) ||
+			   !(S_IRUSR & sbuf->st_mode)) {
+			status = 403;
+		} else {
+			status = STAT_FOUND;
+		}
+		if (stat_stripes) {
+			stat_cache_add(data->file_name, status, sbuf);
+		}
+	}
+	if (status == 404) {
 		request_error(rq->fd, data->file_name, "404", "Not found",
 			      "OS Web Server could not find this file");
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	if (status == 403) {
 		request_error(rq->fd, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
+	return 1;
+}
+
+/* read size bytes at offset in fd into a new file buffer.
+ * Returns the buffer, or NULL if it could not be read or size is 0. */
+static char *
+request_read_at(int fd, off_t offset, int size)
+{
+	char *buf;
+	ssize_t n;
+	int done = 0;
+
+	buf = size ? request_alloc(size) : NULL;
+	while (done < size) {
+		n = pread(fd, buf + done, size - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			request_dealloc(buf);
+			return NULL;
+		}
+		done += n;
+	}
+	return buf;
+}
+
+/* read the checksum that fileset stored with the file in the user.csum
+ * extended attribute, as "csum size mtime". it is only trusted if the file
+ * still has that size and modification time.
+ * Returns 1 and fills csum if a valid checksum was found. */
+static int
+request_get_file_csum(int fd, struct stat *sbuf, unsigned int *csum)
+{
+	char buf[128];
+	ssize_t len;
+	long long size, sec;
+	long nsec;
+
+	len = fgetxattr(fd, "user.csum", buf, sizeof(buf) - 1);
+	if (len < 0) {
+		return 0;
+	}
+	buf[len] = 0;
+	if (sscanf(buf, "%u %lld %lld.%ld", csum, &size, &sec, &nsec) != 4) {
+		return 0;
+	}
+	return size == sbuf->st_size && sec == sbuf->st_mtim.tv_sec &&
+		nsec == sbuf->st_mtim.tv_nsec;
+}
+
+/* the fd cache. it keeps recently used files open, read-only, so that files
+ * that are not kept in memory, e.g. because they are too big for the cache
+ * or lost admission, are not opened and closed on every request. entries
+ * are found by name, and an entry is only used if its file is still the
+ * same inode, with the size and modification and change times, that the
+ * request's stat() found. otherwise the file was replaced or written to,
+ * and the entry is replaced too. requests share an fd, so they read it with
+ * pread(2) and sendfile(2) at explicit offsets and leave its file position
+ * alone. like the stat cache, it is split into stripes, each with its own
+ * lock and an equal share of the entries, and when a stripe is full its
+ * least recently used entry makes room. an entry that is dropped while
+ * requests still use its fd is closed by the last of them. */
+#define FD_STRIPES 16
+#define FD_STRIPE_BUCKETS 256	/* power of 2 */
+
+#define FD_CSUM_UNKNOWN -1	/* an entry's csum_valid before it is read */
+
+struct fd_entry {
+	char *name;
+	unsigned long hash;
+	int fd;
+	struct stat sbuf;	/* of the file when it was opened */
+	int csum_valid;		/* FD_CSUM_UNKNOWN, or what
+				 * request_get_file_csum() returned */
+	unsigned int csum;
+	int refs;		/* requests using fd, plus one while cached */
+	struct fd_entry *hnext;	/* next in the hash chain */
+	struct fd_entry *prev;	/* in the LRU list, most recent first */
+	struct fd_entry *next;
+};
+
+struct fd_stripe {
+	pthread_mutex_t lock;
+	struct fd_entry *table[FD_STRIPE_BUCKETS];
+	struct fd_entry lru;	/* head of the LRU list */
+	int nr_entries;
+	long hits;
+	long stale;
+	long misses;
+} __attribute__((aligned(64)));
+
+static struct fd_stripe *fd_stripes;	/* NULL if disabled */
+static int fd_stripe_size;		/* entries per stripe */
+
+/* keep up to about nr_entries files open. must be called before any
+ * request is served. */
+void
+request_set_fd_cache(int nr_entries)
+{
+	int i;
+
+	fd_stripes = aligned_alloc(64, sizeof(struct fd_stripe) * FD_STRIPES);
+	assert(fd_stripes);
+	memset(fd_stripes, 0, sizeof(struct fd_stripe) * FD_STRIPES);
+	for (i = 0; i < FD_STRIPES; i++) {
+		pthread_mutex_init(&fd_stripes[i].lock, NULL);
+		fd_stripes[i].lru.prev = &fd_stripes[i].lru;
+		fd_stripes[i].lru.next = &fd_stripes[i].lru;
+	}
+	fd_stripe_size = (nr_entries + FD_STRIPES - 1) / FD_STRIPES;
+}
+
+static struct fd_stripe *
+fd_stripe(unsigned long hash)
+{
+	return &fd_stripes[(hash >> 32) % FD_STRIPES];
+}
+
+/* the caller holds s->lock */
+static struct fd_entry **
+fd_find(struct fd_stripe *s, unsigned long hash, const char *name)
+{
+	struct fd_entry **pp;
+
+	for (pp = &s->table[hash % FD_STRIPE_BUCKETS]; *pp;
+	     pp = &(*pp)->hnext) {
+		if ((*pp)->hash == hash && strcmp((*pp)->name, name) == 0) {
+			break;
+		}
+	}
+	return pp;
+}
+
+/* make e the most recently used entry. the caller holds s->lock */
+static void
+fd_lru_add(struct fd_stripe *s, struct fd_entry *e)
+{
+	e->prev = &s->lru;
+	e->next = s->lru.next;
+	s->lru.next->prev = e;
+	s->lru.next = e;
+}
+
+static void
+fd_lru_remove(struct fd_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+/* take e out of s, and drop the reference that s held. returns e if that
+ * was the last one, for the caller to free once it drops s->lock, or NULL.
+ * the caller holds s->lock. */
+static struct fd_entry *
+fd_drop(struct fd_stripe *s, struct fd_entry *e)
+{
+	*fd_find(s, e->hash, e->name) = e->hnext;
+	fd_lru_remove(e);
+	s->nr_entries--;
+	return --e->refs == 0 ? e : NULL;
+}
+
+static void
+fd_free(struct fd_entry *e)
+{
+	if (e == NULL) {
+		return;
+	}
+	SYS(close(e->fd));
+	free(e->name);
+	free(e);
+}
+
+/* is the file that e has open still the one that stat() found to be
+ * sbuf? */
+static int
+fd_matches(struct fd_entry *e, struct stat *sbuf)
+{
+	return e->sbuf.st_ino == sbuf->st_ino &&
+		e->sbuf.st_dev == sbuf->st_dev &&
+		e->sbuf.st_size == sbuf->st_size &&
+		e->sbuf.st_mtim.tv_sec == sbuf->st_mtim.tv_sec &&
+		e->sbuf.st_mtim.tv_nsec == sbuf->st_mtim.tv_nsec &&
+		e->sbuf.st_ctim.tv_sec == sbuf->st_ctim.tv_sec &&
+		e->sbuf.st_ctim.tv_nsec == sbuf->st_ctim.tv_nsec;
+}
+
+/* open name, which stat() found to be sbuf, for reading, or share the fd of
+ * an fd cache entry for it. returns the fd, or -1 if it could not be
+ * opened, and sets *entry to the entry that the fd belongs to, or NULL if
+ * the fd is the caller's to close. */
+static int
+fd_cache_open(const char *name, struct stat *sbuf, struct fd_entry **entry)
+{
+	unsigned long hash = stat_hash(name);
+	struct fd_stripe *s = fd_stripe(hash);
+	struct fd_entry *e, *dead = NULL;
+	struct stat fbuf;
+	int fd;
+
+	*entry = NULL;
+	pthread_mutex_lock(&s->lock);
+	e = *fd_find(s, hash, name);
+	if (e != NULL && fd_matches(e, sbuf)) {
+		e->refs++;
+		fd_lru_remove(e);
+		fd_lru_add(s, e);
+		s->hits++;
+		pthread_mutex_unlock(&s->lock);
+		*entry = e;
+		return e->fd;
+	}
+	if (e != NULL) {
+		/* the file changed since it was opened */
+		dead = fd_drop(s, e);
+		s->stale++;
+	}
+	s->misses++;
+	pthread_mutex_unlock(&s->lock);
+	fd_free(dead);
+
+	fd = open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	/* only cache it if it is the file that was stat'ed */
+	if (fstat(fd, &fbuf) < 0) {
+		return fd;
+	}
+	e = Malloc(sizeof(struct fd_entry));
+	e->sbuf = fbuf;
+	if (!fd_matches(e, sbuf)) {
+		free(e);
+		return fd;
+	}
+	e->name = strdup(name);
+	assert(e->name);
+	e->hash = hash;
+	e->fd = fd;
+	e->csum_valid = FD_CSUM_UNKNOWN;
+	e->refs = 2;
+
+	pthread_mutex_lock(&s->lock);
+	if (*fd_find(s, hash, name) != NULL) {
+		/* another request opened it meanwhile, ours is not cached */
+		pthread_mutex_unlock(&s->lock);
+		free(e->name);
+		free(e);
+		return fd;
+	}
+	e->hnext = NULL;
+	*fd_find(s, hash, name) = e;
+	fd_lru_add(s, e);
+	s->nr_entries++;
+	dead = NULL;
+	if (s->nr_entries > fd_stripe_size) {
+		dead = fd_drop(s, s->lru.prev);
+	}
+	pthread_mutex_unlock(&s->lock);
+	fd_free(dead);
+	*entry = e;
+	return fd;
+}
+
+/* give back an fd that fd_cache_open() returned with entry e */
+static void
+fd_cache_close(struct fd_entry *e)
+{
+	struct fd_stripe *s = fd_stripe(e->hash);
+	int last;
+
+	pthread_mutex_lock(&s->lock);
+	last = --e->refs == 0;
+	pthread_mutex_unlock(&s->lock);
+	if (last) {
+		fd_free(e);
+	}
+}
+
+/* request_get_file_csum() for fd, remembering the result in its fd cache
+ * entry e, if it has one, for as long as the file does not change */
+static int
+fd_cache_csum(int fd, struct fd_entry *e, struct stat *sbuf,
+	      unsigned int *csum)
+{
+	struct fd_stripe *s;
+	int valid;
+
+	if (e == NULL) {
+		return request_get_file_csum(fd, sbuf, csum);
+	}
+	s = fd_stripe(e->hash);
+	pthread_mutex_lock(&s->lock);
+	valid = e->csum_valid;
+	*csum = e->csum;
+	pthread_mutex_unlock(&s->lock);
+	if (valid == FD_CSUM_UNKNOWN) {
+		valid = request_get_file_csum(fd, sbuf, csum);
+		pthread_mutex_lock(&s->lock);
+		e->csum_valid = valid;
+		e->csum = *csum;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return valid;
+}
+
+/* open the file that data is about, which stat() found to be sbuf, for
+ * reading, with the fd cache if it is enabled. returns the fd, or -1, and
+ * sets *entry for request_close() */
+static int
+request_open(struct file_data *data, struct stat *sbuf,
+	     struct fd_entry **entry)
+{
+	if (fd_stripes) {
+		return fd_cache_open(data->file_name, sbuf, entry);
+	}
+	*entry = NULL;
+	return open(data->file_name, O_RDONLY, 0);
+}
+
+static void
+request_close(int fd, struct fd_entry *entry)
+{
+	if (entry) {
+		fd_cache_close(entry);
+	} else {
+		SYS(close(fd));
+	}
+}
+
+/* close data->file_fd, if request_openfile() opened it */
+void
+request_close_file(struct file_data *data)
+{
+	if (data->file_fd >= 0) {
+		request_close(data->file_fd, data->file_fd_entry);
+	}
+	data->file_fd = -1;
+	data->file_fd_entry = NULL;
+}
+
+void
+request_print_fd_stats(FILE *out)
+{
+	long hits = 0, stale = 0, misses = 0, nr_entries = 0;
+	int i;
 
+	if (fd_stripes == NULL) {
+		return;
+	}
+	for (i = 0; i < FD_STRIPES; i++) {
+		pthread_mutex_lock(&fd_stripes[i].lock);
+		hits += fd_stripes[i].hits;
+		stale += fd_stripes[i].stale;
+		misses += fd_stripes[i].misses;
+		nr_entries += fd_stripes[i].nr_entries;
+		pthread_mutex_unlock(&fd_stripes[i].lock);
+	}
+	fprintf(out, "fd cache: %ld open files, %ld hits, %ld misses, "
+		"%ld of them stale\n", nr_entries, hits, misses, stale);
+}
+
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readfile(struct request *rq)
+{
+	int srcfd;
+	struct stat sbuf;
+	struct file_data *data;
+	struct fd_entry *entry;
+	int cached;
+
+	data = rq->data;
+	assert(data);
+
+again:
+	if (!request_statfile(rq, &sbuf, &cached)) {
+		return 0;
+	}
 	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtim;
 
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
+		srcfd = request_open(data, &sbuf, &entry);
+		if (srcfd < 0 && cached) {
+			/* gone since it was stat'ed */
+			request_forget_stat(data->file_name,
+					    strlen(data->file_name) + 1);
+			goto again;
+		}
+		SYS(srcfd);
+		/* at offset 0, the fd may be shared */
+		data->file_buf = request_read_at(srcfd, 0, data->file_size);
+		if (data->file_buf == NULL) {
+			/* shrunk since it was stat'ed */
+			request_close(srcfd, entry);
+			if (cached) {
+				request_forget_stat(data->file_name,
+						    strlen(data->file_name) + 1);
+				goto again;
+			}
+			request_error(rq->fd, data->file_name, "403",
+				      "Forbidden",
+				      "OS Web Server could not read this file");
+			return 0;
+		}
 		/* ask the kernel to stop caching the file */
 		SYS(posix_fadvise(srcfd, 0, data->file_size, 
 				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
+		request_close(srcfd, entry);
 		/* we add this delay to simulate a disk. otherwise, file caching
 		 * doesn't have much benefit because a lot of the time is spent
 		 * in processing (see request_processfile below) and so
@@ -208,6 +978,263 @@ request_readfile(struct request *rq)
 	return 1;
 }
 
+/* read in a copy of filename corresponding to request, of size bytes, that
+ * was saved in fd at offset, instead of the file itself.
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 if the copy could not be read, and sends nothing. */
+int
+request_readfile_from(struct request *rq, int fd, off_t offset, int size)
+{
+	struct file_data *data;
+	char *buf;
+
+	data = rq->data;
+	assert(data);
+
+	buf = request_read_at(fd, offset, size);
+	if (buf == NULL && size > 0) {
+		return 0;
+	}
+	data->file_buf = buf;
+	data->file_size = size;
+	return 1;
+}
+
+/* set data->file_name to the file that a request for uri would get */
+void
+request_set_file_name(struct file_data *data, const char *uri)
+{
+	data->file_name = Malloc(MAXLINE);
+	request_parse_URI(uri, data->file_name, MAXLINE);
+}
+
+/* read in data->file_name without a request, e.g. to cache it before it is
+ * requested, if it may be served and is still size bytes long.
+ * Returns 1 on success, and fills data->file_buf, data->file_size and
+ * data->file_mtime.
+ * Returns 0 on failure. Nothing is sent. */
+int
+request_loadfile(struct file_data *data, int size)
+{
+	int srcfd;
+	struct stat sbuf;
+	char *buf;
+
+	if (request_forbidden(data->file_name) != NULL) {
+		return 0;
+	}
+	srcfd = open(data->file_name, O_RDONLY, 0);
+	if (srcfd < 0) {
+		return 0;
+	}
+	if (fstat(srcfd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    !(S_IRUSR & sbuf.st_mode) || sbuf.st_size != size) {
+		SYS(close(srcfd));
+		return 0;
+	}
+	buf = request_read_at(srcfd, 0, size);
+	if (buf == NULL && size > 0) {
+		SYS(close(srcfd));
+		return 0;
+	}
+	if (size > 0) {
+		/* like request_readfile() */
+		SYS(posix_fadvise(srcfd, 0, size, POSIX_FADV_DONTNEED));
+	}
+	SYS(close(srcfd));
+	data->file_buf = buf;
+	data->file_size = size;
+	data->file_mtime = sbuf.st_mtim;
+	return 1;
+}
+
+/* reading a page of a mapping past the end of its file, which was truncated
+ * since it was mapped, raises SIGBUS. a thread that reads a mapping it just
+ * made sets map_jmp, and the handler jumps back to it. any other SIGBUS is a
+ * bug, and kills the server as it would without the handler. */
+static __thread sigjmp_buf *map_jmp;
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+
+static void
+request_sigbus(int sig)
+{
+	if (map_jmp) {
+		siglongjmp(*map_jmp, 1);
+	}
+	/* the faulting access runs again, and gets the default action */
+	signal(SIGBUS, SIG_DFL);
+}
+
+static void
+request_catch_sigbus(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_sigbus;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGBUS, &sa, NULL));
+}
+
+/* request_prepare_data() for data that maps its file.
+ * Returns 1 on success, and 0 if the file was truncated under the mapping
+ * before it was all read. */
+static int
+request_prepare_mapped(struct file_data *data)
+{
+	sigjmp_buf env;
+
+	if (sigsetjmp(env, 1)) {
+		map_jmp = NULL;
+		return 0;
+	}
+	map_jmp = &env;
+	request_prepare_data(data);
+	map_jmp = NULL;
+	return 1;
+}
+
+/* map filename corresponding to request read-only into memory, instead of
+ * reading it into a buffer. the file's pages are shared with the page cache,
+ * so they are not copied, and we ask the kernel to read them in now and to
+ * keep them. the response is prepared right away, and if the file is
+ * truncated meanwhile, it is read in instead. the mapping shows any later
+ * change to the file, so the caller must stop using it then.
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client. */
+int
+request_mapfile(struct request *rq)
+{
+	int srcfd;
+	struct stat sbuf;
+	struct file_data *data;
+	struct fd_entry *entry;
+	void *buf;
+
+	pthread_once(&map_once, request_catch_sigbus);
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_statfile(rq, &sbuf, NULL)) {
+		return 0;
+	}
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtim;
+
+	if (data->file_size) {
+		SYS(srcfd = request_open(data, &sbuf, &entry));
+		buf = mmap(NULL, data->file_size, PROT_READ, MAP_SHARED,
+			   srcfd, 0);
+		SYS(buf == MAP_FAILED ? -1 : 0);
+		request_close(srcfd, entry);
+		SYS(madvise(buf, data->file_size, MADV_WILLNEED));
+		data->file_buf = buf;
+		data->file_mapped = 1;
+		if (!request_prepare_mapped(data)) {
+			request_free_buf(data);
+			return request_readfile(rq);
+		}
+	}
+	return 1;
+}
+
+/* put together a response header for data, sending length bytes of it in
+ * coding, or as is if coding is NULL */
+static char *
+request_format_header(struct file_data *data, const char *coding, int length,
+		      int *header_size)
+{
+	char buf[MAXBUF], *header;
+	long size = 0;
+
+	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	size += sprintf(buf + size, "Server: OS Web Server\r\n");
+	size += sprintf(buf + size, "Content-Type: %s\r\n", data->file_type);
+	if (coding) {
+		size += sprintf(buf + size, "Content-Encoding: %s\r\n",
+				coding);
+		size += sprintf(buf + size, "X-Decoded-Length: %d\r\n",
+				data->file_size);
+	}
+	size += sprintf(buf + size, "Content-Length: %d\r\n", length);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n",
+			data->file_csum);
+
+	header = Malloc(size);
+	memcpy(header, buf, size);
+	*header_size = size;
+	return header;
+}
+
+/* put together the response header for data */
+static void
+request_build_header(struct file_data *data, unsigned int csum)
+{
+	data->file_type = request_get_file_type(data->file_name);
+	data->file_csum = csum;
+	data->header = request_format_header(data, NULL, data->file_size,
+					     &data->header_size);
+}
+
+/* put together the response header for sending data->file_zbuf as is. the
+ * checksum is still that of the decoded file. data must be prepared. */
+void
+request_prepare_encoded(struct file_data *data, const char *coding)
+{
+	assert(data->header);
+	data->zheader = request_format_header(data, coding, data->file_zsize,
+					      &data->zheader_size);
+}
+
+/* open filename corresponding to request, to send it with sendfile(2)
+ * straight from the file, if it is at least min_size bytes long and its
+ * checksum is known without reading it.
+ * Returns 1 on success, and fills data->file_fd, data->file_size and the
+ * response header. data->file_buf stays NULL.
+ * Returns 0 on failure, sends error to client.
+ * Returns -1 if the file should be read with request_readfile instead, which
+ * then uses the stat() done here. */
+int
+request_openfile(struct request *rq, int min_size)
+{
+	int srcfd;
+	struct stat sbuf;
+	struct file_data *data;
+	struct fd_entry *entry;
+	unsigned int csum;
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_statfile(rq, &sbuf, NULL)) {
+		return 0;
+	}
+	/* save request_readfile() from stat'ing it again */
+	rq->sbuf = sbuf;
+	rq->stat_valid = 1;
+	if (sbuf.st_size < min_size) {
+		return -1;
+	}
+	srcfd = request_open(data, &sbuf, &entry);
+	if (srcfd < 0) {
+		/* gone since it was stat'ed, request_readfile says so */
+		rq->stat_valid = 0;
+		return -1;
+	}
+	if (!fd_cache_csum(srcfd, entry, &sbuf, &csum)) {
+		request_close(srcfd, entry);
+		return -1;
+	}
+	rq->stat_valid = 0;
+	data->file_fd = srcfd;
+	data->file_fd_entry = entry;
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtim;
+	request_build_header(data, csum);
+	return 1;
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -222,12 +1249,10 @@ request_set_data(struct request *rq, struct file_data *data)
  * various server parameters had no affect on server performance. This is not a
  * problem any longer. */
 static void
-request_processfile(struct request *rq)
+request_processfile(struct file_data *data)
 {
-	struct file_data *data;
 	int i, j;
 	volatile int dummy = 0;
-	data = rq->data;
 	assert(data);
 
 	for (i = 0; i < 8; i++) {
@@ -237,37 +1262,89 @@ request_processfile(struct request *rq)
 	}
 }
 
-/* send filename to the fd connection */
+/* compute everything about the response that only depends on the file, and
+ * keep it in data. this is the only place that looks at every byte of the
+ * file, so data that is cached and sent many times is processed once. data
+ * must be prepared before it is shared between requests. */
 void
-request_sendfile(struct request *rq)
+request_prepare_data(struct file_data *data)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
 	int i;
 	unsigned int csum = 0;
-	struct file_data *data;
-	long size = 0;
-
-	data = rq->data;
-	assert(data);
 
-	request_get_file_type(data->file_name, filetype);
+	if (data->header) {
+		return;
+	}
 	/* generate a very trivial checksum */
 	for (i = 0; i < data->file_size; i++) {
 		csum += (unsigned char)(data->file_buf[i]);
 	}
 	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	request_processfile(data);
+	request_build_header(data, csum);
+}
+
+/* like request_prepare_data(), for data that was processed before, e.g. by
+ * a server that saved it, and whose checksum is csum. its bytes are not
+ * looked at again. */
+void
+request_prepare_checked(struct file_data *data, unsigned int csum)
+{
+	if (data->header) {
+		return;
+	}
+	request_build_header(data, csum);
+}
+
+/* bytes of a mapped body sent between checks that its file is unchanged */
+#define MAPPED_CHUNK (64 * 1024)
+
+/* like request_sendfile(), for prepared data whose file_buf maps the file,
+ * which may change while it is sent. the body is sent in MAPPED_CHUNK byte
+ * pieces, and we stop once *changed is set, since what is left no longer
+ * matches the header, or if the file was truncated under the mapping. the
+ * client then gets a short response.
+ * Returns 1 if the whole file was sent, 0 if not. */
+int
+request_sendmapped(struct request *rq, atomic_bool *changed)
+{
+	struct file_data *data;
+	int off, n;
+
+	data = rq->data;
+	assert(data && data->header && data->file_buf);
+
+	Rio_write(rq->fd, data->header, data->header_size);
+	for (off = 0; off < data->file_size; off += n) {
+		if (atomic_load_explicit(changed, memory_order_relaxed)) {
+			return 0;
+		}
+		n = data->file_size - off < MAPPED_CHUNK ?
+			data->file_size - off : MAPPED_CHUNK;
+		if (Rio_write_mapped(rq->fd, data->file_buf + off, n) < 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* send filename to the fd connection */
+void
+request_sendfile(struct request *rq)
+{
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	request_prepare_data(data);
+	Rio_write(rq->fd, data->header, data->header_size);
 
 	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
+	if (data->file_size > 0 && data->file_buf) {
 		Rio_write(rq->fd, data->file_buf, data->file_size);
+	} else if (data->file_size > 0) {
+		/* or the open file, without copying it */
+		Rio_sendfile(rq->fd, data->file_fd, 0, data->file_size);
 	}
 }
@@ -1,16 +1,58 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+struct fd_entry;
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	int file_fd;	 /* or the open file, if file_buf is NULL */
+	struct fd_entry *file_fd_entry; /* fd cache entry file_fd is from */
+	int file_mapped; /* file_buf is a read-only mmap of the file */
+	struct timespec file_mtime; /* of the file when it was read */
+	/* the response, set up by request_prepare_data() */
+	unsigned int file_csum;	/* Content-Csum of file_buf */
+	const char *file_type;	/* Content-Type */
+	char *header;		/* complete response header, or NULL */
+	int header_size;
+	/* the body compressed by the cache, or NULL, and the response header
+	 * for sending it as is, set up by request_prepare_encoded() */
+	char *file_zbuf;
+	int file_zsize;
+	char *zheader;
+	int zheader_size;
 };
 
 struct request *request_init(int connfd, struct file_data *data);
 int request_readfile(struct request *rq);
+int request_openfile(struct request *rq, int min_size);
+int request_mapfile(struct request *rq);
+int request_readfile_from(struct request *rq, int fd, off_t offset, int size);
+void request_set_file_name(struct file_data *data, const char *uri);
+int request_loadfile(struct file_data *data, int size);
 void request_set_data(struct request *rq, struct file_data *data);
+void request_prepare_data(struct file_data *data);
+void request_prepare_checked(struct file_data *data, unsigned int csum);
+void request_prepare_encoded(struct file_data *data, const char *coding);
+int request_accepts_encoding(struct request *rq, const char *coding);
 void request_sendfile(struct request *rq);
+int request_sendmapped(struct request *rq, atomic_bool *changed);
 void request_destroy(struct request *rq);
+void request_set_allocator(void *(*alloc)(size_t size),
+			   void (*dealloc)(void *ptr));
+void request_free_buf(struct file_data *data);
+void request_set_stat_cache(int nr_entries, long ttl_ms);
+void request_forget_stat(const char *prefix, size_t len);
+void request_print_stat_stats(FILE *out);
+void request_set_fd_cache(int nr_entries);
+void request_close_file(struct file_data *data);
+void request_print_fd_stats(FILE *out);
 
 #endif
@@ -7,7 +7,48 @@
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
+ *
+ * Options:
+ *  -s nr_shards  split the cache into nr_shards independently locked shards
+ *                (default: one per worker thread)
+ *  -p policy     cache replacement policy: clock (default), lru, lfu, gdsf,
+ *                arc or s3fifo
+ *  -a            only cache a file if it is requested more often than the
+ *                file it would evict (TinyLFU admission)
+ *  -z            send files that are too big for the cache, or all files if
+ *                there is no cache, with sendfile(2) instead of reading them
+ *                in, if fileset recorded their checksum in an xattr
+ *  -m            cache read-only mmaps of the files instead of copying them
+ *                into the heap. the budget counts mapped bytes, and mapped
+ *                files are not compressed. implies -w, since a mapping
+ *                shows every change made to its file
+ *  -b            allocate cached files from size-class slabs instead of
+ *                malloc, so that the cache budget matches memory use
+ *  -H            like -b, and back the slabs with 2MB huge pages, from the
+ *                hugetlb pool if it has any, else transparent huge pages
+ *  -c            keep cached files compressed if that saves space. they
+ *                are sent as is to clients that accept x-lz4-block encoding
+ *  -d            store the contents of identical files once, so that copies
+ *                of a cached file only take up their name and header
+ *  -S file:size  copy files evicted from the cache to a spill file of size
+ *                bytes, and serve later misses from there when possible
+ *  -P file       save the cache to file on exit, and load the files in it
+ *                that have not changed since on startup
+ *  -I index      read the files listed in a fileset index into the cache
+ *                at startup, in the background, highest priority first
+ *  -w            watch the directories of cached files with inotify, and
+ *                drop files from the cache as soon as they change
+ *  -t ttl_ms     remember for ttl_ms milliseconds what stat(2) said about
+ *                requested files, including that they do not exist or may
+ *                not be read, so repeated misses and errors need no syscall
+ *  -f nr_files   keep up to nr_files recently served files open, so that
+ *                files that are not cached need not be opened every time
+ *  -M            shrink the cache while memory is short, as PSI or the
+ *                memory cgroup's limit show, and grow it back after
+ *  -r            estimate from a sample of the requests how often caches of
+ *                different sizes would miss, and print it on exit
+ *  -v            print cache statistics on exit
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
@@ -16,8 +57,11 @@
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-s nr_shards] [-p policy] [-a] [-z] [-m] "
+		"[-b] [-H] [-c] [-d] [-S file:size] [-P file] "
+		"[-I index] [-w] [-t ttl_ms] [-f nr_files] [-M] [-r] [-v]\n"
+		"\tport nr_threads max_requests max_cache_size\n"
+		"policies: clock lru lfu gdsf arc s3fifo\n", program);
 	exit(1);
 }
 
@@ -56,27 +100,102 @@ int
 main(int argc, char *argv[])
 {
 	int port, nr_threads, max_requests, max_cache_size;
+	struct server_options opts;
+	char *spill_size;
+	int opt;
 	int listenfd, connfd, clientlen;
 	int exitfd;
 	struct sockaddr_in clientaddr;
 	struct server *sv;
 
-	if (argc != 5)
+	server_options_init(&opts);
+	while ((opt = getopt(argc, argv, "s:p:azmbHcdS:P:I:wt:f:Mrv")) != -1) {
+		switch (opt) {
+		case 's':
+			opts.nr_shards = atoi(optarg);
+			break;
+		case 'p':
+			opts.policy = optarg;
+			break;
+		case 'a':
+			opts.admission = 1;
+			break;
+		case 'z':
+			opts.zero_copy = 1;
+			break;
+		case 'm':
+			opts.mmap_cache = 1;
+			opts.watch = 1;
+			break;
+		case 'b':
+			opts.slab = 1;
+			break;
+		case 'H':
+			opts.huge_pages = 1;
+			break;
+		case 'c':
+			opts.compress = 1;
+			break;
+		case 'd':
+			opts.dedup = 1;
+			break;
+		case 'S':
+			spill_size = strrchr(optarg, ':');
+			if (spill_size == NULL || atol(spill_size + 1) <= 0)
+				usage(argv[0]);
+			*spill_size = 0;
+			opts.spill_file = optarg;
+			opts.spill_size = atol(spill_size + 1);
+			break;
+		case 'P':
+			opts.snapshot = optarg;
+			break;
+		case 'I':
+			opts.preload = optarg;
+			break;
+		case 'w':
+			opts.watch = 1;
+			break;
+		case 't':
+			opts.stat_ttl = atol(optarg);
+			if (opts.stat_ttl <= 0)
+				usage(argv[0]);
+			break;
+		case 'f':
+			opts.fd_cache = atoi(optarg);
+			if (opts.fd_cache <= 0)
+				usage(argv[0]);
+			break;
+		case 'M':
+			opts.pressure = 1;
+			break;
+		case 'r':
+			opts.mrc = 1;
+			break;
+		case 'v':
+			opts.stats = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0 ||
+	    opts.nr_shards < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
 	listenfd = open_listenfd(port);
 	exitfd = open_fifo();
@@ -3,278 +3,5280 @@
 #include "common.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/inotify.h>
 
-pthread_mutex_t lock;
-//#define HASH_SIZE 2000000
-int HASH_SIZE = 0;
+struct server {
+	int nr_threads; 
+	int max_requests; 
+	int max_cache_size; 
+	int nr_shards;
+	int zero_copy;
+	int mmap_cache;
+	int stats;
+	const char *snapshot;
+	int exiting;
+
+        int *conn_buf; 
+        pthread_t *threads;
+        int request_head;
+        int request_tail;
+        pthread_mutex_t mutex;
+	pthread_cond_t prod_cond;
+	pthread_cond_t cons_cond;
+        
+	struct cache *web_cache;
+	struct mrc *mrc;	/* NULL if the miss ratio is not estimated */
+};
+
+/* a cached file.
+ *
+ * name and data never change once the entry is published in the hashtable,
+ * so cache hits read them without holding the shard lock. the remaining
+ * fields belong to the replacement policy (see struct cache_policy), which
+ * updates them under the shard lock, except freq, which policies that do not
+ * need the lock on a hit update atomically.
+ *
+ * refs counts one reference held by the hashtable plus one per request that
+ * is sending the file. a sender pins the entry with file_get() so the data
+ * outlives an eviction that happens during a slow network write.
+ *
+ * a file is allocated in one block together with its file_data, name and
+ * response header, and small files with their body too (see file_new()).
+ * the fields that a hit needs come first, so that a hit reads the entry's
+ * first cache line and then the lines right after it. */
+struct file {
+	unsigned long hash;	/* hashing(name) */
+	char *name;
+	struct file_data *data;
+	atomic_int refs;
+	atomic_int freq;	/* hits, as counted by the policy */
+	int size;		/* bytes charged to the shard's budget */
+	bool cached;		/* still in the shard, under shard lock */
+	atomic_bool changed;	/* dropped because its file changed */
+	bool body_inline;	/* data->file_buf is part of the block */
+	struct body *body;	/* shared body, or NULL (see struct body) */
+	int list;		/* which of the policy's lists file is on */
+	struct file *prev;	/* neighbours on that list */
+	struct file *next;
+	double priority;	/* for policies that order files in a heap */
+	int prio_freq;		/* freq when priority was computed */
+	int heap_pos;
+};
+
+#define CACHE_LINE 64
+
+/* epoch-based reclamation. a thread that reads the cache without its shard
+ * lock does so inside epoch_enter()/epoch_exit(). memory unlinked from the
+ * cache is handed to epoch_retire() and is only freed once the global epoch
+ * has advanced twice, i.e. once every thread that could still see it has left
+ * its critical section. */
+struct epoch_record {
+	/* (observed epoch << 1) | 1 while inside a critical section, else 0 */
+	atomic_ulong state;
+	struct epoch_record *next;
+};
+
+struct epoch_retired {
+	void *ptr;
+	void (*free)(void *ptr);
+	unsigned long epoch;	/* global epoch when ptr was retired */
+	struct epoch_retired *next;
+};
+
+struct epoch {
+	atomic_ulong global;
+	pthread_mutex_t lock;	/* protects records and retired */
+	struct epoch_record *_Atomic records;
+	struct epoch_retired *retired;
+};
+
+/* a hashtable slot. the full hash and the name length let a probe skip
+ * almost every non-matching slot without touching the file or its name. */
+struct cache_slot {
+	atomic_ulong hash;
+	atomic_int len;
+	struct file *_Atomic file;	/* NULL if empty */
+};
+
+/* a file that was deleted from a table that is being migrated. probes go on
+ * past it. tables that are not being migrated never contain tombstones. */
+#define SLOT_TOMBSTONE ((struct file *)1)
+
+/* an open-addressing, linearly probed table. size is a power of two. */
+struct cache_index {
+	unsigned long mask;		/* size - 1 */
+	struct cache_slot slots[];
+};
+
+#define INDEX_MIN_SIZE 16
+/* slots moved from the old table to the new one by each insert or delete */
+#define INDEX_MIGRATE_STEP 32
+
+/* a miss that one request is reading from disk. requests for the same file
+ * that miss meanwhile wait for it instead of reading the file again, and then
+ * share the file it loaded. all fields are protected by the shard lock. */
+struct inflight {
+	unsigned long hash;
+	char *name;
+	bool done;
+	bool stale;		/* changed while it was read, do not cache */
+	struct file *file;	/* result, pinned once per waiter, or NULL */
+	int refs;		/* the loading request plus the waiters */
+	pthread_cond_t cond;	/* signalled when done is set */
+	struct inflight *next;
+};
+
+/* the cache is split into independently locked shards. a file always lives in
+ * the shard picked by its name hash, and each shard has its own slice of the
+ * byte budget, its own hashtable and its own replacement policy state.
+ *
+ * the hashtable is sized by the number of files. it doubles when it is 3/4
+ * full and halves when it is 1/8 full. resizing is incremental: the new table
+ * is published at once, and each later update moves a few slots over from
+ * the old table until it is empty and can be retired. */
+struct cache_shard {
+	pthread_mutex_t lock;
+	int curr_size;
+	atomic_int max_size;	/* written under lock, see cache_set_budget() */
+	long data_size;		/* decoded bytes of the files in the shard */
+	void *policy_data;	/* per-shard state of the replacement policy */
+	int nr_files;
+	/* written under lock, read with atomic loads by cache hits */
+	struct cache_index *_Atomic index;
+	struct cache_index *_Atomic old_index;	/* being migrated, or NULL */
+	unsigned long migrate_pos;	/* next old_index slot to migrate */
+	struct inflight *inflight;	/* misses being read from disk */
+	int reclaim_need;	/* largest insert refused for lack of room */
+	struct spill_item *spill_queue;	/* evicted, to be copied to spill */
+	/* bytes of the shared bodies charged to the shard, which any shard
+	 * may give back (see struct body) */
+	atomic_int body_charge;
+	atomic_bool reclaim;	/* the reclaimer has been asked to run */
+} __attribute__((aligned(CACHE_LINE)));
+
+/* a cache replacement policy. all callbacks but hit() are called with the
+ * shard lock held, and hit() is too if locked_hit is set. policies that can
+ * count hits in file->freq alone leave it clear, so that hits take no lock.
+ *
+ * victim() returns the file to evict next, without removing it, or NULL if
+ * every file is pinned. it may reorder the policy's lists on the way, e.g. to
+ * give files a second chance. peek_victim() returns the file that victim()
+ * would return, or a close guess, but changes nothing. remove() takes a file
+ * out of the policy's lists, either because victim() chose it (evicted) or
+ * for another reason. */
+struct cache_policy {
+	const char *name;
+	bool locked_hit;
+	void (*init)(struct cache_shard *shard);
+	void (*destroy)(struct cache_shard *shard);
+	void (*insert)(struct cache_shard *shard, struct file *file);
+	void (*hit)(struct cache_shard *shard, struct file *file);
+	void (*remove)(struct cache_shard *shard, struct file *file,
+		       bool evicted);
+	struct file *(*victim)(struct cache_shard *shard);
+	struct file *(*peek_victim)(struct cache_shard *shard);
+};
+
+/* TinyLFU admission: a count-min sketch of how often each file was requested
+ * recently. rows counters are indexed by independent remixes of the file's
+ * hash, and the estimate is the smallest of them. every sample_size requests
+ * all counters are halved, so the sketch forgets old popularity. counters are
+ * updated with relaxed atomics; a lost update only makes the estimate a
+ * little lower. */
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+
+struct sketch {
+	unsigned long mask;		/* width - 1, width is a power of two */
+	unsigned long sample_size;
+	atomic_ulong additions;
+	atomic_uchar *counters;		/* SKETCH_ROWS rows of width counters */
+};
+
+/* eviction runs in a background reclaimer thread rather than in the request
+ * path. it is woken when a shard fills past RECLAIM_HIGH percent of its
+ * budget, or when an insert is refused for lack of room, and evicts until the
+ * shard is at RECLAIM_LOW percent, or has room for the refused file. it also
+ * frees everything retired by the cache, outside of any lock. */
+#define RECLAIM_HIGH 90
+#define RECLAIM_LOW 75
+/* how often retired memory is reclaimed while some is pending */
+#define RECLAIM_INTERVAL_NS 10000000L
+
+struct cache {
+	int nr_shards;
+	int max_cache_size;		/* the budget we were given */
+	atomic_long budget;		/* what the shards' budgets add up to */
+	struct pressure *pressure;	/* NULL if pressure is ignored */
+	struct cache_shard *shards;
+	const struct cache_policy *policy;
+	struct sketch *sketch;		/* NULL if admission is disabled */
+	struct epoch epoch;
+	bool compress;			/* store bodies compressed */
+	bool dedup;			/* share bodies with the same content */
+	struct body_stripe *bodies;	/* BODY_STRIPES stripes, if dedup */
+	long snapshot_loaded;		/* files reloaded from a snapshot */
+	long snapshot_stale;		/* that had changed since */
+	struct watch *watch;		/* NULL if files are not watched */
+	struct preload *preload;	/* NULL once preloading stopped */
+	long preload_loaded;
+	long preload_skipped;
+	struct spill *spill;		/* NULL if there is no spill tier */
+
+	pthread_t reclaimer;
+	pthread_mutex_t reclaim_lock;	/* protects the two fields below */
+	pthread_cond_t reclaim_cond;
+	bool reclaim_kick;		/* some shard->reclaim was set */
+	bool reclaim_exiting;
+};
+
+/* initialize file data */
+static struct file_data *
+file_data_init(void) 
+{
+	struct file_data *data;
+
+	data = Malloc(sizeof(struct file_data));
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->file_fd = -1;
+	data->file_fd_entry = NULL;
+	data->file_mapped = 0;
+	data->file_mtime.tv_sec = 0;
+	data->file_mtime.tv_nsec = 0;
+	data->header = NULL;
+	data->header_size = 0;
+	data->file_zbuf = NULL;
+	data->file_zsize = 0;
+	data->zheader = NULL;
+	data->zheader_size = 0;
+	return data;
+}
+
+/* free all file data */
+static void 
+file_data_free(struct file_data *data)
+{
+	free(data->file_name);
+	request_free_buf(data);
+	request_close_file(data);
+	free(data->header);
+	free(data->file_zbuf);
+	free(data->zheader);
+	free(data);
+}
+
+static void *do_server_thread(void *arg);
+
+static __thread struct epoch_record *epoch_self;
+
+static void
+epoch_init(struct epoch *ep)
+{
+	atomic_init(&ep->global, 0);
+	pthread_mutex_init(&ep->lock, NULL);
+	atomic_init(&ep->records, NULL);
+	ep->retired = NULL;
+}
+
+/* free every retired pointer from the first epoch in list on */
+static void
+epoch_free_list(struct epoch_retired *list)
+{
+	while (list) {
+		struct epoch_retired *next = list->next;
+
+		list->free(list->ptr);
+		free(list);
+		list = next;
+	}
+}
+
+static void
+epoch_destroy(struct epoch *ep)
+{
+	struct epoch_record *rec = atomic_load(&ep->records);
+
+	/* all worker threads have been joined, nobody can be reading */
+	epoch_free_list(ep->retired);
+	while (rec) {
+		struct epoch_record *next = rec->next;
+
+		free(rec);
+		rec = next;
+	}
+	pthread_mutex_destroy(&ep->lock);
+}
+
+static void
+epoch_enter(struct epoch *ep)
+{
+	struct epoch_record *rec = epoch_self;
+
+	if (rec == NULL) {
+		/* first critical section of this thread: register it */
+		rec = Malloc(sizeof(struct epoch_record));
+		atomic_init(&rec->state, 0);
+		pthread_mutex_lock(&ep->lock);
+		rec->next = atomic_load(&ep->records);
+		atomic_store(&ep->records, rec);
+		pthread_mutex_unlock(&ep->lock);
+		epoch_self = rec;
+	}
+	atomic_store(&rec->state, (atomic_load(&ep->global) << 1) | 1);
+	/* our state must be visible before we load any cache pointer */
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void
+epoch_exit(struct epoch *ep)
+{
+	atomic_store_explicit(&epoch_self->state, 0, memory_order_release);
+}
+
+/* defer free_fn(ptr) until no reader can hold ptr any more */
+static void
+epoch_retire(struct epoch *ep, void *ptr, void (*free_fn)(void *))
+{
+	struct epoch_retired *r = Malloc(sizeof(struct epoch_retired));
+
+	r->ptr = ptr;
+	r->free = free_fn;
+	pthread_mutex_lock(&ep->lock);
+	r->epoch = atomic_load(&ep->global);
+	r->next = ep->retired;
+	ep->retired = r;
+	pthread_mutex_unlock(&ep->lock);
+}
+
+/* try to advance the global epoch and free whatever has become unreachable.
+ * must not be called with a shard lock held, since it frees file data. */
+static void
+epoch_reclaim(struct epoch *ep)
+{
+	struct epoch_record *rec;
+	struct epoch_retired **pp, *done = NULL;
+	unsigned long global;
+
+	pthread_mutex_lock(&ep->lock);
+	if (ep->retired == NULL) {
+		pthread_mutex_unlock(&ep->lock);
+		return;
+	}
+	global = atomic_load(&ep->global);
+	for (rec = atomic_load(&ep->records); rec; rec = rec->next) {
+		unsigned long state = atomic_load(&rec->state);
+
+		if ((state & 1) && (state >> 1) != global) {
+			/* a reader is still in an older epoch */
+			goto out;
+		}
+	}
+	atomic_store(&ep->global, ++global);
+	/* the list is sorted by decreasing epoch, so once we find an entry
+	 * that is two epochs old, it and everything after it are safe */
+	for (pp = &ep->retired; *pp; pp = &(*pp)->next) {
+		if ((*pp)->epoch + 2 <= global) {
+			done = *pp;
+			*pp = NULL;
+			break;
+		}
+	}
+out:
+	pthread_mutex_unlock(&ep->lock);
+	epoch_free_list(done);
+}
+
+/* is anything waiting to be freed? */
+static bool
+epoch_pending(struct epoch *ep)
+{
+	bool pending;
+
+	pthread_mutex_lock(&ep->lock);
+	pending = ep->retired != NULL;
+	pthread_mutex_unlock(&ep->lock);
+	return pending;
+}
+
+/* a size-class slab allocator for cache bodies and entries, enabled with the
+ * slab option. each allocation is rounded up to one of four size classes per
+ * power of two, from 64 bytes to SLAB_MAX_SIZE, and served from that class's
+ * slabs, so files of similar size reuse each other's memory instead of
+ * fragmenting the heap. a slab is a SLAB_SIZE aligned mapping with a header
+ * at its start, so the slab of an object is found by masking its address.
+ * objects are carved from a slab only when first needed, so untouched parts
+ * of a slab take no memory, and a slab is unmapped once it is empty and its
+ * class has another slab with room. larger objects get a mapping of their
+ * own, with the same header.
+ *
+ * with the huge pages option, slabs, which are exactly one 2MB huge page, are
+ * mapped from the hugetlb pool. if the pool is empty or not configured, we
+ * stop trying and ask for transparent huge pages with madvise() instead,
+ * which the kernel may or may not grant. hugetlb slabs are always fully
+ * resident. */
+#define SLAB_SIZE (2UL << 20)
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SIZE (SLAB_SIZE / 8)
+#define SLAB_NR_CLASSES 49	/* 64 bytes, then 4 classes per power of 2 */
+#define SLAB_HEADER CACHE_LINE
+
+struct slab_class;
+
+struct slab {
+	struct slab_class *class;	/* NULL for a single large object */
+	size_t size;		/* bytes mapped */
+	int nr_used;		/* objects allocated */
+	int nr_objs;		/* objects that fit */
+	void *free;		/* list of freed objects */
+	char *unused;		/* objects from here on were never used */
+	struct slab *prev;	/* neighbours on the class's partial list */
+	struct slab *next;
+};
+
+struct slab_class {
+	pthread_mutex_t lock;	/* protects all fields and the class's slabs */
+	size_t size;		/* object size */
+	struct slab *partial;	/* slabs with free objects */
+	long nr_slabs;
+	long nr_used;		/* objects allocated */
+} __attribute__((aligned(CACHE_LINE)));
+
+static bool slab_enabled;
+static bool slab_huge;			/* back slabs with huge pages */
+static atomic_bool slab_hugetlb_failed;	/* fall back to THP */
+static struct slab_class slab_classes[SLAB_NR_CLASSES];
+static atomic_long slab_large_objs;
+static atomic_long slab_large_bytes;
+static atomic_long slab_hugetlb_maps;	/* mappings from the hugetlb pool */
+
+static void
+slab_init(bool huge)
+{
+	int i;
+
+	for (i = 0; i < SLAB_NR_CLASSES; i++) {
+		struct slab_class *c = &slab_classes[i];
+		int shift = SLAB_MIN_SHIFT + (i - 1) / 4;
+
+		pthread_mutex_init(&c->lock, NULL);
+		c->size = i == 0 ? 1UL << SLAB_MIN_SHIFT :
+			(1UL << shift) + (((i - 1) % 4 + 1UL) << (shift - 2));
+		c->partial = NULL;
+		c->nr_slabs = 0;
+		c->nr_used = 0;
+	}
+	assert(slab_classes[SLAB_NR_CLASSES - 1].size == SLAB_MAX_SIZE);
+	slab_enabled = true;
+	slab_huge = huge;
+}
+
+static int
+slab_class_index(size_t size)
+{
+	int shift;
+
+	if (size <= 1UL << SLAB_MIN_SHIFT) {
+		return 0;
+	}
+	/* 2^shift < size <= 2^(shift + 1) */
+	shift = 63 - __builtin_clzl(size - 1);
+	return (shift - SLAB_MIN_SHIFT) * 4 +
+		(((size - 1) >> (shift - 2)) & 3) + 1;
+}
+
+/* map size bytes, aligned to SLAB_SIZE */
+static struct slab *
+slab_map(size_t size)
+{
+	char *p, *aligned;
+	size_t len = size + SLAB_SIZE;
+
+	if (slab_huge && size % HUGE_PAGE_SIZE == 0 &&
+	    !atomic_load_explicit(&slab_hugetlb_failed, memory_order_relaxed)) {
+		/* huge page mappings are aligned to the huge page size */
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			atomic_fetch_add(&slab_hugetlb_maps, 1);
+			return (struct slab *)p;
+		}
+		atomic_store(&slab_hugetlb_failed, true);
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	SYS(p == MAP_FAILED ? -1 : 0);
+	aligned = (char *)(((unsigned long)p + SLAB_SIZE - 1) &
+			   ~(SLAB_SIZE - 1));
+	/* trim the slack on both sides */
+	if (aligned > p) {
+		SYS(munmap(p, aligned - p));
+	}
+	if (aligned + size < p + len) {
+		SYS(munmap(aligned + size, p + len - (aligned + size)));
+	}
+	if (slab_huge && size >= HUGE_PAGE_SIZE) {
+		/* fails if THP is not configured, which is fine */
+		madvise(aligned, size, MADV_HUGEPAGE);
+	}
+	return (struct slab *)aligned;
+}
+
+static struct slab *
+slab_of(void *ptr)
+{
+	return (struct slab *)((unsigned long)ptr & ~(SLAB_SIZE - 1));
+}
+
+static void
+slab_list_del(struct slab_class *c, struct slab *s)
+{
+	if (s->prev) {
+		s->prev->next = s->next;
+	} else {
+		c->partial = s->next;
+	}
+	if (s->next) {
+		s->next->prev = s->prev;
+	}
+}
+
+static void
+slab_list_add(struct slab_class *c, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = c->partial;
+	if (c->partial) {
+		c->partial->prev = s;
+	}
+	c->partial = s;
+}
+
+static void *
+slab_alloc(size_t size)
+{
+	struct slab_class *c;
+	struct slab *s;
+	void *obj;
+
+	if (!slab_enabled) {
+		return Malloc(size);
+	}
+	if (size > SLAB_MAX_SIZE) {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+
+		size = (SLAB_HEADER + size + page_size - 1) & ~(page_size - 1);
+		s = slab_map(size);
+		s->class = NULL;
+		s->size = size;
+		atomic_fetch_add(&slab_large_objs, 1);
+		atomic_fetch_add(&slab_large_bytes, size);
+		return (char *)s + SLAB_HEADER;
+	}
+	c = &slab_classes[slab_class_index(size)];
+	pthread_mutex_lock(&c->lock);
+	s = c->partial;
+	if (s == NULL) {
+		/* the class is full, add a slab */
+		pthread_mutex_unlock(&c->lock);
+		s = slab_map(SLAB_SIZE);
+		s->class = c;
+		s->size = SLAB_SIZE;
+		s->nr_used = 0;
+		s->nr_objs = (SLAB_SIZE - SLAB_HEADER) / c->size;
+		s->free = NULL;
+		s->unused = (char *)s + SLAB_HEADER;
+		pthread_mutex_lock(&c->lock);
+		slab_list_add(c, s);
+		c->nr_slabs++;
+	}
+	if (s->free) {
+		obj = s->free;
+		s->free = *(void **)obj;
+	} else {
+		obj = s->unused;
+		s->unused += c->size;
+	}
+	if (++s->nr_used == s->nr_objs) {
+		slab_list_del(c, s);
+	}
+	c->nr_used++;
+	pthread_mutex_unlock(&c->lock);
+	return obj;
+}
+
+static void
+slab_free(void *ptr)
+{
+	struct slab_class *c;
+	struct slab *s;
+
+	if (!slab_enabled) {
+		free(ptr);
+		return;
+	}
+	if (ptr == NULL) {
+		return;
+	}
+	s = slab_of(ptr);
+	c = s->class;
+	if (c == NULL) {
+		atomic_fetch_sub(&slab_large_objs, 1);
+		atomic_fetch_sub(&slab_large_bytes, s->size);
+		SYS(munmap(s, s->size));
+		return;
+	}
+	pthread_mutex_lock(&c->lock);
+	*(void **)ptr = s->free;
+	s->free = ptr;
+	c->nr_used--;
+	if (s->nr_used-- == s->nr_objs) {
+		/* it was full, it has room again */
+		slab_list_add(c, s);
+	} else if (s->nr_used == 0 &&
+		   (c->partial != s || s->next != NULL)) {
+		/* keep the last slab with room, to avoid thrashing */
+		slab_list_del(c, s);
+		c->nr_slabs--;
+		pthread_mutex_unlock(&c->lock);
+		SYS(munmap(s, SLAB_SIZE));
+		return;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* bytes actually taken up by an object of size bytes at ptr */
+static size_t
+slab_charge(void *ptr, size_t size)
+{
+	struct slab *s;
+
+	if (!slab_enabled || ptr == NULL) {
+		return size;
+	}
+	s = slab_of(ptr);
+	return s->class ? s->class->size : s->size;
+}
+
+static void
+slab_print_stats(FILE *out)
+{
+	int i;
+
+	fprintf(out, "slab: class   size   slabs    objs    bytes used\n");
+	for (i = 0; i < SLAB_NR_CLASSES; i++) {
+		struct slab_class *c = &slab_classes[i];
+
+		pthread_mutex_lock(&c->lock);
+		if (c->nr_slabs > 0) {
+			fprintf(out, "slab: %5d %6zu %7ld %7ld %13zu\n", i,
+				c->size, c->nr_slabs, c->nr_used,
+				c->nr_used * c->size);
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+	fprintf(out, "slab: large objs %ld bytes %ld\n",
+		atomic_load(&slab_large_objs), atomic_load(&slab_large_bytes));
+	if (slab_huge) {
+		fprintf(out, "slab: %ld hugetlb mappings%s\n",
+			atomic_load(&slab_hugetlb_maps),
+			atomic_load(&slab_hugetlb_failed) ?
+			", then fell back to THP" : "");
+	}
+}
+
+/* a small LZ77 codec for the compressed cache tier. the output is in the LZ4
+ * block format, so any LZ4 block decoder can read it: a sequence of
+ *
+ *	token: literal length << 4 | (match length - 4)
+ *	more literal length bytes if it was 15, each added, ending with < 255
+ *	the literals
+ *	match offset, 2 bytes little endian, 1 to 65535
+ *	more match length bytes if it was 15
+ *
+ * the last sequence has literals only, and ends the block. as the format
+ * requires, the last 5 bytes are always literals, and no match starts in the
+ * last 12 bytes. matches are found greedily with a hash of 4 bytes. */
+#define LZ_CODING "x-lz4-block"
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+/* don't bother with files smaller than this */
+#define LZ_MIN_SIZE 256
+
+static unsigned int
+lz_read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int
+lz_hash(unsigned int v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* write a length that did not fit in the token */
+static unsigned char *
+lz_put_length(unsigned char *op, int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/* emit the literals from lit to lit + nr_lit, then the match, if match_len
+ * is not 0. returns NULL if it would go past end. */
+static unsigned char *
+lz_put_sequence(unsigned char *op, unsigned char *end,
+		const unsigned char *lit, int nr_lit, int offset,
+		int match_len)
+{
+	unsigned char *token;
+	int ml = match_len - LZ_MIN_MATCH;
+
+	/* worst case for the token, lengths, literals and offset */
+	if (end - op < 1 + nr_lit / 255 + 1 + nr_lit + 2 +
+	    (match_len ? ml / 255 + 1 : 0)) {
+		return NULL;
+	}
+	token = op++;
+	*token = (nr_lit < 15 ? nr_lit : 15) << 4;
+	if (nr_lit >= 15) {
+		op = lz_put_length(op, nr_lit - 15);
+	}
+	memcpy(op, lit, nr_lit);
+	op += nr_lit;
+	if (match_len == 0) {
+		return op;
+	}
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	*token |= ml < 15 ? ml : 15;
+	if (ml >= 15) {
+		op = lz_put_length(op, ml - 15);
+	}
+	return op;
+}
+
+/* compress n bytes from src into dst, which has room for cap bytes. returns
+ * the compressed size, or 0 if it does not fit. */
+static int
+lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int table[1 << LZ_HASH_BITS];
+	const unsigned char *anchor = src;
+	unsigned char *op = dst, *end = dst + cap;
+	int i = 0, j;
+
+	for (j = 0; j < (1 << LZ_HASH_BITS); j++) {
+		table[j] = -1;
+	}
+	while (i < n - LZ_MATCH_LIMIT) {
+		unsigned int seq = lz_read32(src + i);
+		unsigned int h = lz_hash(seq);
+		int ref = table[h];
+		int len;
+
+		table[h] = i;
+		if (ref < 0 || i - ref > LZ_MAX_OFFSET ||
+		    lz_read32(src + ref) != seq) {
+			i++;
+			continue;
+		}
+		len = LZ_MIN_MATCH;
+		while (i + len < n - LZ_LAST_LITERALS &&
+		       src[ref + len] == src[i + len]) {
+			len++;
+		}
+		op = lz_put_sequence(op, end, anchor, src + i - anchor, i - ref,
+				     len);
+		if (op == NULL) {
+			return 0;
+		}
+		i += len;
+		anchor = src + i;
+	}
+	op = lz_put_sequence(op, end, anchor, src + n - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+/* read a length that did not fit in the token. returns -1 if src ends. */
+static int
+lz_get_length(const unsigned char **ip, const unsigned char *end)
+{
+	int len = 0;
+	unsigned char b;
+
+	do {
+		if (*ip >= end) {
+			return -1;
+		}
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+/* decompress n bytes from src into dst, which has room for cap bytes.
+ * returns the decompressed size, or -1 if src is corrupt. */
+static int
+lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	const unsigned char *ip = src, *end = src + n;
+	unsigned char *op = dst;
+
+	while (ip < end) {
+		int token = *ip++;
+		int len = token >> 4;
+		int offset, extra;
+
+		if (len == 15) {
+			if ((extra = lz_get_length(&ip, end)) < 0) {
+				return -1;
+			}
+			len += extra;
+		}
+		if (end - ip < len || dst + cap - op < len) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		if (ip == end) {
+			/* the last sequence */
+			break;
+		}
+		if (end - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op - dst) {
+			return -1;
+		}
+		len = token & 15;
+		if (len == 15) {
+			if ((extra = lz_get_length(&ip, end)) < 0) {
+				return -1;
+			}
+			len += extra;
+		}
+		len += LZ_MIN_MATCH;
+		if (dst + cap - op < len) {
+			return -1;
+		}
+		/* byte by byte, the match may overlap what it produces */
+		while (len-- > 0) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+	return op - dst;
+}
+
+/* per thread buffer that compressed files are decompressed into */
+static __thread char *lz_buf;
+static __thread int lz_buf_size;
+
+static char *
+lz_buffer(int size)
+{
+	if (size > lz_buf_size) {
+		free(lz_buf);
+		lz_buf = Malloc(size);
+		lz_buf_size = size;
+	}
+	return lz_buf;
+}
+
+static void
+lz_buffer_free(void)
+{
+	free(lz_buf);
+	lz_buf = NULL;
+	lz_buf_size = 0;
+}
+
+/* compress the body of prepared data into data->file_zbuf, if that saves at
+ * least an eighth of it */
+static void
+file_data_compress(struct file_data *data)
+{
+	int cap = data->file_size - data->file_size / 8;
+	char *zbuf;
+	int zsize;
+
+	if (data->file_size < LZ_MIN_SIZE || data->file_mapped) {
+		/* a mapping is kept as it is, see request_mapfile() */
+		return;
+	}
+	zbuf = Malloc(cap);
+	zsize = lz_compress((unsigned char *)data->file_buf, data->file_size,
+			    (unsigned char *)zbuf, cap);
+	if (zsize == 0) {
+		free(zbuf);
+		return;
+	}
+	data->file_zbuf = zbuf;
+	data->file_zsize = zsize;
+	request_prepare_encoded(data, LZ_CODING);
+}
+
+/* does name start with the len bytes at prefix? with the terminating NUL
+ * included in len, it is the same name. */
+static bool
+name_matches(const char *name, const char *prefix, size_t len)
+{
+	return strncmp(name, prefix, len) == 0;
+}
+
+/* the spill tier. files evicted from memory are copied to a preallocated
+ * spill file, which is used as a ring, so that a later miss can read them
+ * back from there instead of from the origin file. only the bodies are in the
+ * file; the index of copies, with each file's response header, is in memory.
+ * once the ring wraps around, new copies overwrite the oldest ones, except
+ * that a copy that is being read cannot be overwritten, so if one is in the
+ * way, the new copy is dropped instead. copies are written by the reclaimer,
+ * outside of any shard lock, and a file that is already in the spill file is
+ * not written again. */
+struct spill_entry {
+	char *name;
+	unsigned long hash;
+	off_t offset;
+	int size;			/* of the body */
+	struct timespec mtime;		/* of the file it is a copy of */
+	unsigned int csum;
+	const char *type;
+	char *header;
+	int header_size;
+	int readers;			/* requests reading the copy */
+	bool stale;			/* the file changed since */
+	struct spill_entry *hnext;	/* next in the hash chain */
+	struct spill_entry *next;	/* next newer copy */
+};
+
+struct spill {
+	int fd;
+	char *path;
+	off_t size;
+	pthread_mutex_t lock;		/* protects the fields below */
+	off_t head;			/* where the next copy goes */
+	struct spill_entry *oldest;	/* copies in the order written */
+	struct spill_entry *newest;
+	struct spill_entry **table;	/* chained hashtable of copies */
+	unsigned long mask;		/* buckets - 1 */
+	long nr_entries;
+	long bytes;			/* in live copies */
+	long hits;
+	long writes;
+	long dropped;			/* copies that did not fit */
+	unsigned long generation;	/* bumped by each invalidation */
+};
+
+/* a file evicted from a shard, waiting to be copied to the spill file */
+struct spill_item {
+	struct file *file;		/* pinned */
+	struct spill_item *next;
+};
+
+#define SPILL_MIN_BUCKETS 64
+
+static struct spill *
+spill_init(const char *path, off_t size)
+{
+	struct spill *sp = Malloc(sizeof(struct spill));
+	int err;
+
+	SYS(sp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600));
+	err = posix_fallocate(sp->fd, 0, size);
+	if (err) {
+		fprintf(stderr, "spill file %s: %s\n", path, strerror(err));
+		exit(1);
+	}
+	sp->path = strdup(path);
+	assert(sp->path);
+	sp->size = size;
+	pthread_mutex_init(&sp->lock, NULL);
+	sp->head = 0;
+	sp->oldest = NULL;
+	sp->newest = NULL;
+	sp->mask = SPILL_MIN_BUCKETS - 1;
+	sp->table = calloc(SPILL_MIN_BUCKETS, sizeof(struct spill_entry *));
+	assert(sp->table);
+	sp->nr_entries = 0;
+	sp->bytes = 0;
+	sp->hits = 0;
+	sp->writes = 0;
+	sp->dropped = 0;
+	sp->generation = 0;
+	return sp;
+}
+
+static void
+spill_entry_free(struct spill_entry *e)
+{
+	free(e->name);
+	free(e->header);
+	free(e);
+}
+
+/* the spill file is scratch space, it goes away with the server */
+static void
+spill_destroy(struct spill *sp)
+{
+	while (sp->oldest) {
+		struct spill_entry *e = sp->oldest;
+
+		sp->oldest = e->next;
+		spill_entry_free(e);
+	}
+	SYS(close(sp->fd));
+	SYS(unlink(sp->path));
+	free(sp->path);
+	free(sp->table);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp);
+}
+
+/* the caller holds sp->lock */
+static struct spill_entry *
+spill_find(struct spill *sp, unsigned long hash, char *name)
+{
+	struct spill_entry *e;
+
+	for (e = sp->table[hash & sp->mask]; e; e = e->hnext) {
+		if (e->hash == hash && !e->stale && strcmp(e->name, name) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* the caller holds sp->lock */
+static void
+spill_resize(struct spill *sp, unsigned long buckets)
+{
+	struct spill_entry **table = calloc(buckets,
+					    sizeof(struct spill_entry *));
+	struct spill_entry *e;
+
+	assert(table);
+	for (e = sp->oldest; e; e = e->next) {
+		e->hnext = table[e->hash & (buckets - 1)];
+		table[e->hash & (buckets - 1)] = e;
+	}
+	free(sp->table);
+	sp->table = table;
+	sp->mask = buckets - 1;
+}
+
+/* drop the oldest copy. the caller holds sp->lock. */
+static void
+spill_drop_oldest(struct spill *sp)
+{
+	struct spill_entry *e = sp->oldest, **pp;
+
+	assert(e && e->readers == 0);
+	for (pp = &sp->table[e->hash & sp->mask]; *pp != e;
+	     pp = &(*pp)->hnext);
+	*pp = e->hnext;
+	sp->oldest = e->next;
+	if (sp->oldest == NULL) {
+		sp->newest = NULL;
+	}
+	sp->nr_entries--;
+	sp->bytes -= e->size;
+	spill_entry_free(e);
+}
+
+/* is e in the way of a copy of size bytes written at sp->head, or at 0 if
+ * it does not fit before the end of the file? */
+static bool
+spill_in_way(struct spill *sp, struct spill_entry *e, int size)
+{
+	if (sp->head + size > sp->size) {
+		return e->offset >= sp->head || e->offset < size;
+	}
+	return e->offset >= sp->head && e->offset < sp->head + size;
+}
+
+/* find room for a copy of size bytes, dropping the oldest copies that are
+ * in the way. those are always the oldest ones, since copies are written in
+ * order around the ring. returns false if one of them is being read. the
+ * caller holds sp->lock. */
+static bool
+spill_reserve(struct spill *sp, int size, off_t *offset)
+{
+	struct spill_entry *e;
+
+	if (size > sp->size) {
+		return false;
+	}
+	for (e = sp->oldest; e && spill_in_way(sp, e, size); e = e->next) {
+		if (e->readers) {
+			return false;
+		}
+	}
+	while (sp->oldest && spill_in_way(sp, sp->oldest, size)) {
+		spill_drop_oldest(sp);
+	}
+	if (sp->head + size > sp->size) {
+		sp->head = 0;
+	}
+	*offset = sp->head;
+	sp->head += size;
+	return true;
+}
+
+static unsigned long
+spill_generation(struct spill *sp)
+{
+	unsigned long generation;
+
+	pthread_mutex_lock(&sp->lock);
+	generation = sp->generation;
+	pthread_mutex_unlock(&sp->lock);
+	return generation;
+}
+
+/* mark the copies of the files whose names match as stale, so that they
+ * are not read again. their space is reused when the ring comes around. */
+static void
+spill_invalidate(struct spill *sp, const char *prefix, size_t len)
+{
+	struct spill_entry *e;
+
+	pthread_mutex_lock(&sp->lock);
+	sp->generation++;
+	for (e = sp->oldest; e; e = e->next) {
+		if (name_matches(e->name, prefix, len)) {
+			e->stale = true;
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* copy an evicted file to the spill file. only the reclaimer calls this,
+ * with the generation of sp from before it took the file off the spill
+ * queue. the copy is dropped if some file changed since, since it may be
+ * this one. */
+static void
+spill_write(struct spill *sp, struct file *file, unsigned long generation)
+{
+	struct file_data *data = file->data;
+	struct spill_entry *e;
+	char *body = data->file_buf;
+	int size = data->file_size;
+	off_t offset;
+	bool found, reserved;
+	ssize_t n;
+	int done = 0;
+
+	pthread_mutex_lock(&sp->lock);
+	found = spill_find(sp, file->hash, file->name) != NULL;
+	pthread_mutex_unlock(&sp->lock);
+	if (found || size == 0) {
+		return;
+	}
+	if (data->file_zbuf) {
+		body = lz_buffer(size);
+		lz_decompress((unsigned char *)data->file_zbuf,
+			      data->file_zsize, (unsigned char *)body, size);
+	}
+	pthread_mutex_lock(&sp->lock);
+	reserved = spill_reserve(sp, size, &offset);
+	if (!reserved) {
+		sp->dropped++;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	if (!reserved) {
+		return;
+	}
+	while (done < size) {
+		n = pwrite(sp->fd, body + done, size - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			/* the space stays reserved, but nothing points to it */
+			pthread_mutex_lock(&sp->lock);
+			sp->dropped++;
+			pthread_mutex_unlock(&sp->lock);
+			return;
+		}
+		done += n;
+	}
+
+	e = Malloc(sizeof(struct spill_entry));
+	e->name = strdup(file->name);
+	assert(e->name);
+	e->hash = file->hash;
+	e->offset = offset;
+	e->size = size;
+	e->mtime = data->file_mtime;
+	e->csum = data->file_csum;
+	e->type = data->file_type;
+	e->header = Malloc(data->header_size);
+	memcpy(e->header, data->header, data->header_size);
+	e->header_size = data->header_size;
+	e->readers = 0;
+	e->stale = false;
+	e->next = NULL;
+
+	pthread_mutex_lock(&sp->lock);
+	if (sp->generation != generation) {
+		/* the space stays reserved, but nothing points to it */
+		sp->dropped++;
+		pthread_mutex_unlock(&sp->lock);
+		spill_entry_free(e);
+		return;
+	}
+	e->hnext = sp->table[e->hash & sp->mask];
+	sp->table[e->hash & sp->mask] = e;
+	if (sp->newest) {
+		sp->newest->next = e;
+	} else {
+		sp->oldest = e;
+	}
+	sp->newest = e;
+	sp->nr_entries++;
+	sp->bytes += size;
+	sp->writes++;
+	if (sp->nr_entries > (long)sp->mask + 1) {
+		spill_resize(sp, (sp->mask + 1) * 2);
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* load the requested file from its copy in the spill file, if there is one,
+ * along with its response header. returns 1 on success, else 0, and sends
+ * nothing either way. */
+static int
+spill_read(struct spill *sp, struct request *rq, struct file_data *data,
+	   unsigned long hash)
+{
+	struct spill_entry *e;
+	int ret;
+
+	pthread_mutex_lock(&sp->lock);
+	e = spill_find(sp, hash, data->file_name);
+	if (e) {
+		/* keeps the copy from being overwritten */
+		e->readers++;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	if (e == NULL) {
+		return 0;
+	}
+	ret = request_readfile_from(rq, sp->fd, e->offset, e->size);
+	if (ret) {
+		data->file_mtime = e->mtime;
+		data->file_csum = e->csum;
+		data->file_type = e->type;
+		data->header = Malloc(e->header_size);
+		memcpy(data->header, e->header, e->header_size);
+		data->header_size = e->header_size;
+	}
+	pthread_mutex_lock(&sp->lock);
+	e->readers--;
+	if (ret) {
+		sp->hits++;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return ret;
+}
+
+static void
+spill_print_stats(struct spill *sp, FILE *out)
+{
+	pthread_mutex_lock(&sp->lock);
+	fprintf(out, "spill: %ld files, %ld of %lld bytes, %ld hits, "
+		"%ld writes, %ld dropped\n", sp->nr_entries, sp->bytes,
+		(long long)sp->size, sp->hits, sp->writes, sp->dropped);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+struct file *cache_lookup(struct cache_shard *shard, unsigned long hash,
+			  char *name);
+bool cache_insert(struct cache *cache, struct cache_shard *shard,
+		  struct file *file);
+bool cache_evict(struct cache *cache, struct cache_shard *shard,
+		 int file_size);
+
+unsigned long hashing(char *string);
+
+/* content deduplication. with it enabled, the body of each cached file is
+ * kept apart from its entry, in a body that files with the same content
+ * share, so that a copy of a file costs only its entry, name and header.
+ * bodies are keyed by the checksum and size of the file and matched by
+ * comparing their bytes. the cache keeps one table of the bodies that cached
+ * files use, whichever shards the files are in, split into stripes by key
+ * that each have their own lock. a stripe lock may be taken with a shard
+ * lock held, but not the other way around.
+ *
+ * a body is charged once, while it is in the table: to the budget of the
+ * shard of the first file that used it, until the last file that uses it
+ * leaves the cache, in whatever shard that is. so that it need not take
+ * that shard's lock, the charge is kept in shard->body_charge.
+ *
+ * refs counts the files that point at the body, cached or not, so a body
+ * lives as long as the last of them. users counts the cached ones only. */
+#define BODY_STRIPES 16
+
+struct body {
+	unsigned long key;	/* body_key() */
+	char *buf;		/* the body, compressed if the files are */
+	int size;		/* bytes at buf */
+	int file_size;		/* decoded bytes */
+	int charge;		/* bytes charged while it is in the table */
+	bool compressed;
+	bool body_inline;	/* buf is part of the block */
+	bool mapped;		/* else buf is a read-only mmap */
+	/* under the lock of the body's stripe */
+	int users;		/* cached files using it */
+	struct cache_shard *charged;	/* shard it is charged to */
+	atomic_int refs;
+	struct body *next;	/* in the stripe's table */
+};
+
+struct body_stripe {
+	pthread_mutex_t lock;
+	struct body **bodies;	/* chained hashtable of bodies in use */
+	unsigned long mask;	/* buckets - 1 */
+	long nr_bodies;
+	long body_size;		/* bytes in those bodies */
+	long shared_size;	/* bytes in the bodies of the cached files */
+} __attribute__((aligned(CACHE_LINE)));
+
+static void
+body_put(struct body *body)
+{
+	struct file_data tmp;
+
+	if (atomic_fetch_sub(&body->refs, 1) != 1) {
+		return;
+	}
+	if (!body->body_inline) {
+		tmp.file_buf = body->buf;
+		tmp.file_size = body->size;
+		tmp.file_mapped = body->mapped;
+		request_free_buf(&tmp);
+	}
+	slab_free(body);
+}
+
+static void
+file_free(void *ptr)
+{
+	struct file *file = ptr;
+
+	if (file->body) {
+		body_put(file->body);
+	} else if (!file->body_inline) {
+		request_free_buf(file->data);
+	}
+	slab_free(file);
+}
+
+/* pin a file found by a lock-free lookup. fails if the last reference is
+ * already gone, i.e. the file was evicted and is waiting to be freed. the
+ * caller is inside an epoch critical section, so the file itself is valid. */
+static bool
+file_get(struct file *file)
+{
+	int refs = atomic_load(&file->refs);
+
+	while (refs > 0) {
+		if (atomic_compare_exchange_weak(&file->refs, &refs, refs + 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* drop a reference. the last one retires the file: a lock-free reader may
+ * still be about to file_get() it, so it is freed after a grace period. */
+static void
+file_put(struct cache *cache, struct file *file)
+{
+	if (atomic_fetch_sub(&file->refs, 1) == 1) {
+		epoch_retire(&cache->epoch, file, file_free);
+	}
+}
+
+/* circular doubly linked lists of files with a sentinel head. head->next is
+ * the front (most recently inserted) and head->prev the back. */
+static void
+list_init(struct file *head)
+{
+	head->prev = head->next = head;
+}
+
+static bool
+list_empty(struct file *head)
+{
+	return head->next == head;
+}
+
+static void
+list_del(struct file *file)
+{
+	file->prev->next = file->next;
+	file->next->prev = file->prev;
+	file->prev = file->next = NULL;
+}
+
+static void
+list_add(struct file *head, struct file *file)
+{
+	file->prev = head;
+	file->next = head->next;
+	head->next->prev = file;
+	head->next = file;
+}
+
+static void
+list_move(struct file *head, struct file *file)
+{
+	list_del(file);
+	list_add(head, file);
+}
+
+/* a file that is being sent cannot be evicted */
+static bool
+file_pinned(struct file *file)
+{
+	return atomic_load(&file->refs) > 1;
+}
+
+static int
+file_freq(struct file *file)
+{
+	return atomic_load_explicit(&file->freq, memory_order_relaxed);
+}
+
+static void
+file_set_freq(struct file *file, int freq)
+{
+	atomic_store_explicit(&file->freq, freq, memory_order_relaxed);
+}
+
+/* ghost lists remember the hashes and sizes of recently evicted files, so
+ * that ARC and S3-FIFO can tell a returning file from a new one. */
+struct ghost {
+	unsigned long hash;
+	int size;
+	struct ghost *prev;	/* FIFO order, newest at head.next */
+	struct ghost *next;
+	struct ghost *chain;	/* next ghost in the same bucket */
+};
+
+struct ghost_list {
+	struct ghost head;
+	struct ghost **buckets;
+	unsigned long mask;
+	int count;
+	long bytes;
+};
+
+static void
+ghost_list_init(struct ghost_list *gl)
+{
+	gl->head.prev = gl->head.next = &gl->head;
+	gl->mask = INDEX_MIN_SIZE - 1;
+	gl->buckets = calloc(gl->mask + 1, sizeof(struct ghost *));
+	assert(gl->buckets);
+	gl->count = 0;
+	gl->bytes = 0;
+}
+
+static void
+ghost_list_destroy(struct ghost_list *gl)
+{
+	struct ghost *g = gl->head.next;
+
+	while (g != &gl->head) {
+		struct ghost *next = g->next;
+
+		free(g);
+		g = next;
+	}
+	free(gl->buckets);
+}
+
+static void
+ghost_unlink(struct ghost_list *gl, struct ghost *g)
+{
+	struct ghost **pp = &gl->buckets[g->hash & gl->mask];
+
+	while (*pp != g) {
+		pp = &(*pp)->chain;
+	}
+	*pp = g->chain;
+	g->prev->next = g->next;
+	g->next->prev = g->prev;
+	gl->count--;
+	gl->bytes -= g->size;
+	free(g);
+}
+
+static void
+ghost_add(struct ghost_list *gl, unsigned long hash, int size)
+{
+	struct ghost *g = Malloc(sizeof(struct ghost));
+
+	if ((unsigned long)gl->count >= gl->mask + 1) {
+		/* keep chains short by doubling the buckets */
+		unsigned long mask = gl->mask * 2 + 1;
+		struct ghost **buckets = calloc(mask + 1, sizeof(struct ghost *));
+		struct ghost *o;
+
+		assert(buckets);
+		for (o = gl->head.next; o != &gl->head; o = o->next) {
+			o->chain = buckets[o->hash & mask];
+			buckets[o->hash & mask] = o;
+		}
+		free(gl->buckets);
+		gl->buckets = buckets;
+		gl->mask = mask;
+	}
+	g->hash = hash;
+	g->size = size;
+	g->chain = gl->buckets[hash & gl->mask];
+	gl->buckets[hash & gl->mask] = g;
+	g->prev = &gl->head;
+	g->next = gl->head.next;
+	gl->head.next->prev = g;
+	gl->head.next = g;
+	gl->count++;
+	gl->bytes += size;
+}
+
+/* remove hash from the list. returns whether it was there. */
+static bool
+ghost_take(struct ghost_list *gl, unsigned long hash)
+{
+	struct ghost *g;
+
+	for (g = gl->buckets[hash & gl->mask]; g; g = g->chain) {
+		if (g->hash == hash) {
+			ghost_unlink(gl, g);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* forget the oldest ghosts until the list holds at most bytes */
+static void
+ghost_trim(struct ghost_list *gl, long bytes)
+{
+	while (gl->bytes > bytes && gl->count > 0) {
+		ghost_unlink(gl, gl->head.prev);
+	}
+}
+
+/* return the file nearest the back of list that is not pinned. pinned files
+ * are moved to the front, so the scan ends after one lap. */
+static struct file *
+list_victim(struct file *head, int nr_files)
+{
+	while (!list_empty(head) && nr_files-- >= 0) {
+		struct file *file = head->prev;
+
+		if (!file_pinned(file)) {
+			return file;
+		}
+		list_move(head, file);
+	}
+	return NULL;
+}
+
+/* the file list_victim() would return, without moving pinned files */
+static struct file *
+list_peek_victim(struct file *head)
+{
+	struct file *file;
+
+	for (file = head->prev; file != head; file = file->prev) {
+		if (!file_pinned(file)) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+/* LRU: exact recency order, so hits move the file under the shard lock. */
+struct lru {
+	struct file list;
+};
+
+static void
+lru_init(struct cache_shard *shard)
+{
+	struct lru *lru = Malloc(sizeof(struct lru));
+
+	list_init(&lru->list);
+	shard->policy_data = lru;
+}
+
+static void
+lru_destroy(struct cache_shard *shard)
+{
+	free(shard->policy_data);
+}
+
+static void
+lru_insert(struct cache_shard *shard, struct file *file)
+{
+	struct lru *lru = shard->policy_data;
+
+	list_add(&lru->list, file);
+}
+
+static void
+lru_hit(struct cache_shard *shard, struct file *file)
+{
+	struct lru *lru = shard->policy_data;
+
+	list_move(&lru->list, file);
+}
+
+static void
+lru_remove(struct cache_shard *shard, struct file *file, bool evicted)
+{
+	list_del(file);
+}
+
+static struct file *
+lru_victim(struct cache_shard *shard)
+{
+	struct lru *lru = shard->policy_data;
+
+	return list_victim(&lru->list, shard->nr_files);
+}
+
+static struct file *
+lru_peek_victim(struct cache_shard *shard)
+{
+	struct lru *lru = shard->policy_data;
+
+	return list_peek_victim(&lru->list);
+}
+
+/* CLOCK: hits only set file->freq, and the victim search gives every file
+ * that was hit since it was last looked at a second chance. it shares the
+ * list with LRU. */
+static void
+clock_hit(struct cache_shard *shard, struct file *file)
+{
+	if (!file_freq(file)) {
+		file_set_freq(file, 1);
+	}
+}
+
+static struct file *
+clock_victim(struct cache_shard *shard)
+{
+	struct lru *lru = shard->policy_data;
+	/* every file gets at most two looks: one to clear its referenced bit,
+	 * and one to find it still pinned */
+	int budget = 2 * shard->nr_files;
+
+	while (!list_empty(&lru->list) && budget-- > 0) {
+		struct file *file = lru->list.prev;
+
+		if (file_freq(file)) {
+			file_set_freq(file, 0);
+		} else if (!file_pinned(file)) {
+			return file;
+		}
+		list_move(&lru->list, file);
+	}
+	return NULL;
+}
+
+/* the first file from the back that was not hit, or if all were, the one
+ * clock_victim() finds after clearing their bits */
+static struct file *
+clock_peek_victim(struct cache_shard *shard)
+{
+	struct lru *lru = shard->policy_data;
+	struct file *file, *first = NULL;
+
+	for (file = lru->list.prev; file != &lru->list; file = file->prev) {
+		if (file_pinned(file)) {
+			continue;
+		}
+		if (!file_freq(file)) {
+			return file;
+		}
+		if (first == NULL) {
+			first = file;
+		}
+	}
+	return first;
+}
+
+/* LFU and GDSF keep files in a min-heap ordered by a priority that grows
+ * with the number of hits. hits only count in file->freq without the lock.
+ * the heap is brought up to date lazily: a victim candidate whose priority
+ * is stale is re-prioritized and sifted down before it can be chosen.
+ *
+ * both policies age the cache by adding the priority of the last evicted
+ * file to that of new and refreshed files (LFU with dynamic aging), so files
+ * that were hot long ago eventually leave. */
+struct heap {
+	struct file **files;
+	int len;
+	int cap;
+	double age;
+	double (*priority)(struct file *file, double age);
+};
+
+/* priority of a file that was just inserted or hit. file->prio_freq is the
+ * hit count the file's priority was computed with. */
+static void
+heap_prioritize(struct heap *h, struct file *file)
+{
+	file->prio_freq = file_freq(file);
+	file->priority = h->priority(file, h->age);
+}
+
+static double
+lfu_priority(struct file *file, double age)
+{
+	return age + file_freq(file);
+}
+
+/* GreedyDual-Size-Frequency: hits per byte, so one large file does not keep
+ * many small, equally popular files out of the cache */
+static double
+gdsf_priority(struct file *file, double age)
+{
+	return age + (double)file_freq(file) / (file->size + 1);
+}
+
+static void
+heap_swap(struct heap *h, int i, int j)
+{
+	struct file *tmp = h->files[i];
+
+	h->files[i] = h->files[j];
+	h->files[j] = tmp;
+	h->files[i]->heap_pos = i;
+	h->files[j]->heap_pos = j;
+}
+
+static void
+heap_up(struct heap *h, int i)
+{
+	while (i > 0 && h->files[i]->priority < h->files[(i - 1) / 2]->priority) {
+		heap_swap(h, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void
+heap_down(struct heap *h, int i)
+{
+	while (1) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < h->len && h->files[l]->priority < h->files[min]->priority)
+			min = l;
+		if (r < h->len && h->files[r]->priority < h->files[min]->priority)
+			min = r;
+		if (min == i)
+			break;
+		heap_swap(h, i, min);
+		i = min;
+	}
+}
+
+static void
+heap_push(struct heap *h, struct file *file)
+{
+	if (h->len == h->cap) {
+		h->cap = h->cap ? h->cap * 2 : INDEX_MIN_SIZE;
+		h->files = realloc(h->files, h->cap * sizeof(struct file *));
+		assert(h->files);
+	}
+	file->heap_pos = h->len;
+	h->files[h->len++] = file;
+	heap_up(h, file->heap_pos);
+}
+
+static void
+heap_del(struct heap *h, struct file *file)
+{
+	int i = file->heap_pos;
+
+	heap_swap(h, i, --h->len);
+	if (i < h->len) {
+		heap_down(h, i);
+		heap_up(h, i);
+	}
+}
+
+static void
+heap_init(struct cache_shard *shard,
+	  double (*priority)(struct file *file, double age))
+{
+	struct heap *h = Malloc(sizeof(struct heap));
+
+	h->files = NULL;
+	h->len = h->cap = 0;
+	h->age = 0;
+	h->priority = priority;
+	shard->policy_data = h;
+}
+
+static void
+lfu_init(struct cache_shard *shard)
+{
+	heap_init(shard, lfu_priority);
+}
+
+static void
+gdsf_init(struct cache_shard *shard)
+{
+	heap_init(shard, gdsf_priority);
+}
+
+static void
+heap_destroy(struct cache_shard *shard)
+{
+	struct heap *h = shard->policy_data;
+
+	free(h->files);
+	free(h);
+}
+
+static void
+heap_insert(struct cache_shard *shard, struct file *file)
+{
+	struct heap *h = shard->policy_data;
+
+	file_set_freq(file, 1);
+	heap_prioritize(h, file);
+	heap_push(h, file);
+}
+
+static void
+heap_hit(struct cache_shard *shard, struct file *file)
+{
+	atomic_fetch_add_explicit(&file->freq, 1, memory_order_relaxed);
+}
+
+static void
+heap_remove(struct cache_shard *shard, struct file *file, bool evicted)
+{
+	struct heap *h = shard->policy_data;
+
+	if (evicted) {
+		h->age = file->priority;
+	}
+	heap_del(h, file);
+}
+
+static struct file *
+heap_victim(struct cache_shard *shard)
+{
+	struct heap *h = shard->policy_data;
+	struct file *pinned = NULL, *victim = NULL;
+
+	while (h->len > 0) {
+		struct file *file = h->files[0];
+
+		if (file_freq(file) != file->prio_freq) {
+			/* hit since its priority was computed */
+			heap_prioritize(h, file);
+			heap_down(h, 0);
+			continue;
+		}
+		if (!file_pinned(file)) {
+			victim = file;
+			break;
+		}
+		/* set pinned files aside, chaining them through prev */
+		heap_del(h, file);
+		file->prev = pinned;
+		pinned = file;
+	}
+	while (pinned) {
+		struct file *next = pinned->prev;
+
+		pinned->prev = NULL;
+		heap_push(h, pinned);
+		pinned = next;
+	}
+	return victim;
+}
+
+/* a stale priority is never higher than the file's up to date one, so the
+ * heap still orders lower bounds of the priorities. heap_peek_victim()
+ * searches it best first, from the top, for the unpinned file of lowest up
+ * to date priority, and stops when no file below the ones it has not looked
+ * at yet can be lower. it looks at no more than HEAP_PEEK_MAX files. */
+#define HEAP_PEEK_MAX 64
+
+static struct file *
+heap_peek_victim(struct cache_shard *shard)
+{
+	struct heap *h = shard->policy_data;
+	int open[HEAP_PEEK_MAX + 2];	/* heap positions left to look at */
+	int nr_open = 0, looked = 0;
+	struct file *victim = NULL;
+	double lowest = 0;
+
+	if (h->len > 0) {
+		open[nr_open++] = 0;
+	}
+	while (nr_open > 0 && looked++ < HEAP_PEEK_MAX) {
+		struct file *file;
+		double priority;
+		int i, min = 0, pos;
+
+		for (i = 1; i < nr_open; i++) {
+			if (h->files[open[i]]->priority <
+			    h->files[open[min]]->priority) {
+				min = i;
+			}
+		}
+		pos = open[min];
+		open[min] = open[--nr_open];
+		file = h->files[pos];
+		if (victim && file->priority >= lowest) {
+			break;
+		}
+		if (!file_pinned(file)) {
+			priority = file_freq(file) == file->prio_freq ?
+				file->priority : h->priority(file, h->age);
+			if (victim == NULL || priority < lowest) {
+				victim = file;
+				lowest = priority;
+			}
+		}
+		for (i = 2 * pos + 1; i <= 2 * pos + 2 && i < h->len; i++) {
+			open[nr_open++] = i;
+		}
+	}
+	return victim;
+}
+
+/* ARC, adapted to variable-sized files by counting bytes instead of pages.
+ * t1 holds files seen once recently and t2 files seen at least twice; b1 and
+ * b2 remember what was evicted from each. a miss that hits b1 means t1 was
+ * too small, one that hits b2 means t2 was, and target, the byte size t1 is
+ * aimed at, moves accordingly. */
+struct arc {
+	struct file t1, t2;
+	long t1_bytes, t2_bytes;
+	struct ghost_list b1, b2;
+	long target;
+};
+
+#define ARC_T1 0
+#define ARC_T2 1
+
+static void
+arc_init(struct cache_shard *shard)
+{
+	struct arc *arc = Malloc(sizeof(struct arc));
+
+	list_init(&arc->t1);
+	list_init(&arc->t2);
+	arc->t1_bytes = arc->t2_bytes = 0;
+	ghost_list_init(&arc->b1);
+	ghost_list_init(&arc->b2);
+	arc->target = 0;
+	shard->policy_data = arc;
+}
+
+static void
+arc_destroy(struct cache_shard *shard)
+{
+	struct arc *arc = shard->policy_data;
+
+	ghost_list_destroy(&arc->b1);
+	ghost_list_destroy(&arc->b2);
+	free(arc);
+}
+
+static void
+arc_insert(struct cache_shard *shard, struct file *file)
+{
+	struct arc *arc = shard->policy_data;
+	long size = file->size;
+	long c = shard->max_size;
+	long delta;
+
+	if (ghost_take(&arc->b1, file->hash)) {
+		delta = arc->b2.bytes > arc->b1.bytes ?
+			size * arc->b2.bytes / (arc->b1.bytes + 1) : size;
+		arc->target = arc->target + delta < c ? arc->target + delta : c;
+		file->list = ARC_T2;
+	} else if (ghost_take(&arc->b2, file->hash)) {
+		delta = arc->b1.bytes > arc->b2.bytes ?
+			size * arc->b1.bytes / (arc->b2.bytes + 1) : size;
+		arc->target = arc->target > delta ? arc->target - delta : 0;
+		file->list = ARC_T2;
+	} else {
+		file->list = ARC_T1;
+	}
+	if (file->list == ARC_T1) {
+		list_add(&arc->t1, file);
+		arc->t1_bytes += size;
+	} else {
+		list_add(&arc->t2, file);
+		arc->t2_bytes += size;
+	}
+	/* the ghosts of t1 and the ghosts of both lists together are bounded
+	 * by one and two cache sizes */
+	ghost_trim(&arc->b1, c - arc->t1_bytes);
+	ghost_trim(&arc->b2, 2 * c - arc->t1_bytes - arc->t2_bytes -
+		   arc->b1.bytes);
+}
+
+static void
+arc_hit(struct cache_shard *shard, struct file *file)
+{
+	struct arc *arc = shard->policy_data;
+
+	if (file->list == ARC_T1) {
+		arc->t1_bytes -= file->size;
+		arc->t2_bytes += file->size;
+		file->list = ARC_T2;
+	}
+	list_move(&arc->t2, file);
+}
+
+static void
+arc_remove(struct cache_shard *shard, struct file *file, bool evicted)
+{
+	struct arc *arc = shard->policy_data;
+
+	list_del(file);
+	if (file->list == ARC_T1) {
+		arc->t1_bytes -= file->size;
+		if (evicted)
+			ghost_add(&arc->b1, file->hash, file->size);
+	} else {
+		arc->t2_bytes -= file->size;
+		if (evicted)
+			ghost_add(&arc->b2, file->hash, file->size);
+	}
+}
+
+static struct file *
+arc_victim(struct cache_shard *shard)
+{
+	struct arc *arc = shard->policy_data;
+	struct file *file = NULL;
+
+	if (arc->t1_bytes > 0 &&
+	    (arc->t1_bytes > arc->target || list_empty(&arc->t2))) {
+		file = list_victim(&arc->t1, shard->nr_files);
+	}
+	if (file == NULL) {
+		file = list_victim(&arc->t2, shard->nr_files);
+	}
+	if (file == NULL) {
+		file = list_victim(&arc->t1, shard->nr_files);
+	}
+	return file;
+}
+
+static struct file *
+arc_peek_victim(struct cache_shard *shard)
+{
+	struct arc *arc = shard->policy_data;
+	struct file *file = NULL;
+
+	if (arc->t1_bytes > 0 &&
+	    (arc->t1_bytes > arc->target || list_empty(&arc->t2))) {
+		file = list_peek_victim(&arc->t1);
+	}
+	if (file == NULL) {
+		file = list_peek_victim(&arc->t2);
+	}
+	if (file == NULL) {
+		file = list_peek_victim(&arc->t1);
+	}
+	return file;
+}
+
+/* S3-FIFO: new files enter a small FIFO that takes a tenth of the shard. a
+ * file that is hit at least twice before it reaches the end of the small
+ * FIFO moves to the main FIFO, the others are evicted after a single pass,
+ * which keeps one-hit wonders and scans from flushing the cache. the main
+ * FIFO reinserts files that were hit since their last pass (CLOCK-like).
+ * files that come back soon after leaving the small FIFO are recognized by
+ * a ghost list and go straight to the main FIFO. hits only bump file->freq,
+ * capped at 3, without the lock. */
+struct s3fifo {
+	struct file small, main;
+	long small_bytes, main_bytes;
+	struct ghost_list ghost;
+};
+
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+
+static void
+s3fifo_init(struct cache_shard *shard)
+{
+	struct s3fifo *s3 = Malloc(sizeof(struct s3fifo));
+
+	list_init(&s3->small);
+	list_init(&s3->main);
+	s3->small_bytes = s3->main_bytes = 0;
+	ghost_list_init(&s3->ghost);
+	shard->policy_data = s3;
+}
+
+static void
+s3fifo_destroy(struct cache_shard *shard)
+{
+	struct s3fifo *s3 = shard->policy_data;
+
+	ghost_list_destroy(&s3->ghost);
+	free(s3);
+}
+
+static void
+s3fifo_add(struct s3fifo *s3, struct file *file, int list)
+{
+	file->list = list;
+	if (list == S3FIFO_SMALL) {
+		list_add(&s3->small, file);
+		s3->small_bytes += file->size;
+	} else {
+		list_add(&s3->main, file);
+		s3->main_bytes += file->size;
+	}
+}
+
+static void
+s3fifo_del(struct s3fifo *s3, struct file *file)
+{
+	list_del(file);
+	if (file->list == S3FIFO_SMALL) {
+		s3->small_bytes -= file->size;
+	} else {
+		s3->main_bytes -= file->size;
+	}
+}
+
+static void
+s3fifo_insert(struct cache_shard *shard, struct file *file)
+{
+	struct s3fifo *s3 = shard->policy_data;
+
+	file_set_freq(file, 0);
+	if (ghost_take(&s3->ghost, file->hash)) {
+		s3fifo_add(s3, file, S3FIFO_MAIN);
+	} else {
+		s3fifo_add(s3, file, S3FIFO_SMALL);
+	}
+}
+
+static void
+s3fifo_hit(struct cache_shard *shard, struct file *file)
+{
+	int freq = file_freq(file);
+
+	if (freq < 3) {
+		file_set_freq(file, freq + 1);
+	}
+}
+
+static void
+s3fifo_remove(struct cache_shard *shard, struct file *file, bool evicted)
+{
+	struct s3fifo *s3 = shard->policy_data;
+
+	s3fifo_del(s3, file);
+	if (evicted && file->list == S3FIFO_SMALL) {
+		ghost_add(&s3->ghost, file->hash, file->size);
+		/* remember about as many bytes as the main FIFO holds */
+		ghost_trim(&s3->ghost, shard->max_size - shard->max_size / 10);
+	}
+}
+
+static struct file *
+s3fifo_victim(struct cache_shard *shard)
+{
+	struct s3fifo *s3 = shard->policy_data;
+	/* each file is moved at most four times: up to three times around
+	 * the main FIFO and once from the small one */
+	int budget = 4 * shard->nr_files + 1;
+
+	while (budget-- > 0) {
+		struct file *file;
+
+		if (!list_empty(&s3->small) &&
+		    (s3->small_bytes > shard->max_size / 10 ||
+		     list_empty(&s3->main))) {
+			file = s3->small.prev;
+			if (file_freq(file) > 1) {
+				s3fifo_del(s3, file);
+				file_set_freq(file, 0);
+				s3fifo_add(s3, file, S3FIFO_MAIN);
+			} else if (file_pinned(file)) {
+				list_move(&s3->small, file);
+			} else {
+				return file;
+			}
+		} else if (!list_empty(&s3->main)) {
+			file = s3->main.prev;
+			if (file_freq(file) > 0) {
+				file_set_freq(file, file_freq(file) - 1);
+				list_move(&s3->main, file);
+			} else if (file_pinned(file)) {
+				list_move(&s3->main, file);
+			} else {
+				return file;
+			}
+		} else {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* follows s3fifo_victim() without moving anything. files that it would move
+ * from the small FIFO to the main one are only subtracted from the small
+ * FIFO's size. in the main FIFO, the file it would evict is the first
+ * unpinned one from the back among those hit the fewest times. */
+static struct file *
+s3fifo_peek_victim(struct cache_shard *shard)
+{
+	struct s3fifo *s3 = shard->policy_data;
+	long small_bytes = s3->small_bytes;
+	bool main_empty = list_empty(&s3->main);
+	struct file *file, *victim = NULL;
+
+	for (file = s3->small.prev; file != &s3->small; file = file->prev) {
+		if (small_bytes <= shard->max_size / 10 && !main_empty) {
+			break;
+		}
+		if (file_freq(file) > 1) {
+			small_bytes -= file->size;
+			main_empty = false;
+		} else if (!file_pinned(file)) {
+			return file;
+		}
+	}
+	if (file == &s3->small &&
+	    (small_bytes > shard->max_size / 10 || main_empty)) {
+		/* only pinned files are left where victim() would look */
+		return NULL;
+	}
+	for (file = s3->main.prev; file != &s3->main; file = file->prev) {
+		if (!file_pinned(file) &&
+		    (victim == NULL || file_freq(file) < file_freq(victim))) {
+			victim = file;
+		}
+	}
+	return victim;
+}
+
+static const struct cache_policy cache_policies[] = {
+	{ "clock", false, lru_init, lru_destroy, lru_insert, clock_hit,
+	  lru_remove, clock_victim, clock_peek_victim },
+	{ "lru", true, lru_init, lru_destroy, lru_insert, lru_hit,
+	  lru_remove, lru_victim, lru_peek_victim },
+	{ "lfu", false, lfu_init, heap_destroy, heap_insert, heap_hit,
+	  heap_remove, heap_victim, heap_peek_victim },
+	{ "gdsf", false, gdsf_init, heap_destroy, heap_insert, heap_hit,
+	  heap_remove, heap_victim, heap_peek_victim },
+	{ "arc", true, arc_init, arc_destroy, arc_insert, arc_hit,
+	  arc_remove, arc_victim, arc_peek_victim },
+	{ "s3fifo", false, s3fifo_init, s3fifo_destroy, s3fifo_insert,
+	  s3fifo_hit, s3fifo_remove, s3fifo_victim, s3fifo_peek_victim },
+};
+
+static const struct cache_policy *
+cache_policy_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(cache_policies) / sizeof(cache_policies[0]); i++) {
+		if (strcmp(cache_policies[i].name, name) == 0) {
+			return &cache_policies[i];
+		}
+	}
+	return NULL;
+}
+
+static const unsigned long sketch_seeds[SKETCH_ROWS] = {
+	0x9e3779b97f4a7c15UL, 0xbf58476d1ce4e5b9UL,
+	0x94d049bb133111ebUL, 0xd6e8feb86659fd93UL,
+};
+
+/* width is rounded up to a power of two */
+static struct sketch *
+sketch_init(unsigned long width)
+{
+	struct sketch *sk = Malloc(sizeof(struct sketch));
+	unsigned long i;
+
+	sk->mask = 64;
+	while (sk->mask < width) {
+		sk->mask <<= 1;
+	}
+	/* the TinyLFU paper ages after about ten times as many requests as
+	 * there are items being tracked */
+	sk->sample_size = 10 * sk->mask;
+	sk->mask--;
+	atomic_init(&sk->additions, 0);
+	sk->counters = Malloc(SKETCH_ROWS * (sk->mask + 1) *
+			      sizeof(atomic_uchar));
+	for (i = 0; i < SKETCH_ROWS * (sk->mask + 1); i++) {
+		atomic_init(&sk->counters[i], 0);
+	}
+	return sk;
+}
+
+static void
+sketch_destroy(struct sketch *sk)
+{
+	free(sk->counters);
+	free(sk);
+}
+
+static atomic_uchar *
+sketch_counter(struct sketch *sk, int row, unsigned long hash)
+{
+	unsigned long h = (hash ^ (hash >> 29)) * sketch_seeds[row];
+
+	return &sk->counters[row * (sk->mask + 1) + ((h >> 32) & sk->mask)];
+}
+
+static int
+sketch_estimate(struct sketch *sk, unsigned long hash)
+{
+	int row, min = SKETCH_MAX;
+
+	for (row = 0; row < SKETCH_ROWS; row++) {
+		int c = atomic_load_explicit(sketch_counter(sk, row, hash),
+					     memory_order_relaxed);
+		if (c < min) {
+			min = c;
+		}
+	}
+	return min;
+}
+
+/* halve every counter. requests that race with this may be counted before
+ * or after the halving, which does not matter for an estimate. */
+static void
+sketch_age(struct sketch *sk)
+{
+	unsigned long i;
+
+	for (i = 0; i < SKETCH_ROWS * (sk->mask + 1); i++) {
+		int c = atomic_load_explicit(&sk->counters[i],
+					     memory_order_relaxed);
+		atomic_store_explicit(&sk->counters[i], c >> 1,
+				      memory_order_relaxed);
+	}
+}
+
+/* count a request for the file with the given hash */
+static void
+sketch_add(struct sketch *sk, unsigned long hash)
+{
+	int row;
+	unsigned long n;
+
+	/* conservative update: only raise the counters that are at the
+	 * current minimum, which keeps hot files from inflating cold ones */
+	int min = sketch_estimate(sk, hash);
+
+	if (min < SKETCH_MAX) {
+		for (row = 0; row < SKETCH_ROWS; row++) {
+			atomic_uchar *c = sketch_counter(sk, row, hash);
+
+			if (atomic_load_explicit(c, memory_order_relaxed) == min) {
+				atomic_store_explicit(c, min + 1,
+						      memory_order_relaxed);
+			}
+		}
+	}
+	n = atomic_fetch_add_explicit(&sk->additions, 1, memory_order_relaxed);
+	if (n + 1 == sk->sample_size) {
+		/* exactly one request sees the count reach sample_size */
+		sketch_age(sk);
+		atomic_fetch_sub_explicit(&sk->additions, sk->sample_size,
+					  memory_order_relaxed);
+	}
+}
+
+/* djb2 string hash */
+unsigned long
+hashing(char *string)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *string++) != '\0')
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+	return hash;
+}
+
+/* the hashtable slot is taken from the low bits of the hash, so pick the shard
+ * from the high bits of a multiplicative remix to keep the two independent */
+static struct cache_shard *
+cache_shard(struct cache *cache, unsigned long hash)
+{
+	unsigned long mix = (hash * 0x9e3779b97f4a7c15UL) >> 32;
+
+	return &cache->shards[mix % cache->nr_shards];
+}
+
+static struct cache_index *
+index_alloc(unsigned long size)
+{
+	struct cache_index *t;
+	unsigned long i;
+
+	t = Malloc(sizeof(struct cache_index) + size * sizeof(struct cache_slot));
+	t->mask = size - 1;
+	for (i = 0; i < size; i++) {
+		atomic_init(&t->slots[i].hash, 0);
+		atomic_init(&t->slots[i].len, 0);
+		atomic_init(&t->slots[i].file, NULL);
+	}
+	return t;
+}
+
+static void
+index_free(void *ptr)
+{
+	free(ptr);
+}
+
+/* find name in t, or return NULL. on success *pos is the slot of the file. */
+static struct file *
+index_find(struct cache_index *t, unsigned long hash, int len, char *name,
+	   unsigned long *pos)
+{
+	unsigned long i = hash & t->mask;
+	struct file *file;
+
+	while ((file = atomic_load_explicit(&t->slots[i].file,
+					    memory_order_acquire)) != NULL) {
+		if (file != SLOT_TOMBSTONE &&
+		    atomic_load_explicit(&t->slots[i].hash,
+					 memory_order_relaxed) == hash &&
+		    atomic_load_explicit(&t->slots[i].len,
+					 memory_order_relaxed) == len &&
+		    strcmp(file->name, name) == 0) {
+			*pos = i;
+			return file;
+		}
+		i = (i + 1) & t->mask;
+	}
+	return NULL;
+}
+
+/* store file in slot i of t. the hash and length are written first, so that a
+ * reader that sees the file also sees the slot's key. */
+static void
+index_set(struct cache_index *t, unsigned long i, unsigned long hash, int len,
+	  struct file *file)
+{
+	atomic_store_explicit(&t->slots[i].hash, hash, memory_order_relaxed);
+	atomic_store_explicit(&t->slots[i].len, len, memory_order_relaxed);
+	atomic_store_explicit(&t->slots[i].file, file, memory_order_release);
+}
+
+/* add a file that is not in t yet */
+static void
+index_add(struct cache_index *t, unsigned long hash, int len,
+	  struct file *file)
+{
+	unsigned long i = hash & t->mask;
+
+	while (atomic_load_explicit(&t->slots[i].file,
+				    memory_order_relaxed) != NULL) {
+		i = (i + 1) & t->mask;
+	}
+	index_set(t, i, hash, len, file);
+}
+
+/* empty slot pos, shifting later files of the probe run back into the hole so
+ * that no run is broken and no tombstone is needed */
+static void
+index_delete(struct cache_index *t, unsigned long pos)
+{
+	unsigned long i = pos, j = pos;
+
+	while (1) {
+		struct file *file;
+		unsigned long home;
+
+		j = (j + 1) & t->mask;
+		file = atomic_load_explicit(&t->slots[j].file,
+					    memory_order_relaxed);
+		if (file == NULL) {
+			break;
+		}
+		home = atomic_load_explicit(&t->slots[j].hash,
+					    memory_order_relaxed) & t->mask;
+		/* the file at j can only move to i if its home slot does not
+		 * lie in the cyclic range (i, j] */
+		if (((j - home) & t->mask) < ((j - i) & t->mask)) {
+			continue;
+		}
+		index_set(t, i, atomic_load_explicit(&t->slots[j].hash,
+						     memory_order_relaxed),
+			  atomic_load_explicit(&t->slots[j].len,
+					       memory_order_relaxed), file);
+		i = j;
+	}
+	atomic_store_explicit(&t->slots[i].file, NULL, memory_order_release);
+}
+
+/* move up to nr slots of old_index into index. the old table is never
+ * shifted, so migrated files stay visible in it to lock-free readers until the
+ * whole table is retired. the caller holds shard->lock. */
+static void
+index_migrate(struct cache *cache, struct cache_shard *shard, unsigned long nr)
+{
+	struct cache_index *old = atomic_load(&shard->old_index);
+	struct cache_index *t = atomic_load(&shard->index);
+
+	if (old == NULL) {
+		return;
+	}
+	for (; nr > 0 && shard->migrate_pos <= old->mask; nr--) {
+		struct cache_slot *s = &old->slots[shard->migrate_pos++];
+		struct file *file = atomic_load_explicit(&s->file,
+							 memory_order_relaxed);
+
+		if (file != NULL && file != SLOT_TOMBSTONE) {
+			index_add(t, atomic_load_explicit(&s->hash,
+							  memory_order_relaxed),
+				  atomic_load_explicit(&s->len,
+						       memory_order_relaxed),
+				  file);
+		}
+	}
+	if (shard->migrate_pos > old->mask) {
+		atomic_store(&shard->old_index, NULL);
+		epoch_retire(&cache->epoch, old, index_free);
+	}
+}
+
+/* start moving the shard's files to a table of the given size */
+static void
+index_resize(struct cache *cache, struct cache_shard *shard,
+	     unsigned long size)
+{
+	/* finish any migration that is still going on first */
+	index_migrate(cache, shard, ~0UL);
+	/* readers look in old_index before index, so a file is always in at
+	 * least one of the two tables they load */
+	atomic_store(&shard->old_index, atomic_load(&shard->index));
+	atomic_store(&shard->index, index_alloc(size));
+	shard->migrate_pos = 0;
+}
+
+/* the caller either holds shard->lock or is inside an epoch critical section.
+ * in the latter case a concurrent update may make us miss, but never return
+ * a freed entry. hash is hashing(name). */
+struct file *
+cache_lookup(struct cache_shard *shard, unsigned long hash, char *name)
+{
+	struct cache_index *old = atomic_load(&shard->old_index);
+	struct cache_index *t = atomic_load(&shard->index);
+	int len = strlen(name);
+	unsigned long pos;
+	struct file *file = NULL;
+
+	if (old != NULL) {
+		file = index_find(old, hash, len, name, &pos);
+	}
+	if (file == NULL) {
+		file = index_find(t, hash, len, name, &pos);
+	}
+	return file;
+}
+
+/* add a new file to the shard's hashtable. the caller holds shard->lock. */
+static void
+cache_index_add(struct cache *cache, struct cache_shard *shard,
+		struct file *file)
+{
+	struct cache_index *t = atomic_load(&shard->index);
+
+	if ((unsigned long)(shard->nr_files + 1) > (t->mask + 1) / 4 * 3) {
+		index_resize(cache, shard, (t->mask + 1) * 2);
+		t = atomic_load(&shard->index);
+	}
+	index_add(t, file->hash, strlen(file->name), file);
+	index_migrate(cache, shard, INDEX_MIGRATE_STEP);
+}
+
+/* remove a file from the shard's hashtable. the caller holds shard->lock. */
+static void
+cache_index_delete(struct cache *cache, struct cache_shard *shard,
+		   struct file *file)
+{
+	struct cache_index *old = atomic_load(&shard->old_index);
+	struct cache_index *t = atomic_load(&shard->index);
+	int len = strlen(file->name);
+	unsigned long pos;
+
+	if (index_find(t, file->hash, len, file->name, &pos) == file) {
+		index_delete(t, pos);
+	}
+	/* the old table may still hold a copy that lock-free readers see */
+	if (old != NULL &&
+	    index_find(old, file->hash, len, file->name, &pos) == file) {
+		atomic_store_explicit(&old->slots[pos].file, SLOT_TOMBSTONE,
+				      memory_order_release);
+	}
+	if (t->mask + 1 > INDEX_MIN_SIZE &&
+	    (unsigned long)shard->nr_files < (t->mask + 1) / 8) {
+		index_resize(cache, shard, (t->mask + 1) / 2);
+	} else {
+		index_migrate(cache, shard, INDEX_MIGRATE_STEP);
+	}
+}
+
+/* bytes of the cache budget that data takes up. a mapped file takes up
+ * whole pages, and a slab allocated one its whole size class. */
+static int
+file_data_charge(struct file_data *data)
+{
+	long page_size;
+
+	if (!data->file_mapped) {
+		return slab_charge(data->file_buf, data->file_size);
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+	return (data->file_size + page_size - 1) & ~(page_size - 1);
+}
+
+/* files up to this size are stored inline, in the same block as their entry */
+#define FILE_INLINE_MAX 8192
+
+#define BODY_MIN_BUCKETS 64
+
+static unsigned long
+body_key(struct file_data *data)
+{
+	unsigned long key = (unsigned long)data->file_csum << 32 |
+		(unsigned int)data->file_size;
+
+	/* mix both into the low bits that pick the bucket */
+	key *= 0x9e3779b97f4a7c15UL;
+	return key ^ key >> 32;
+}
+
+/* the body of prepared data, as file_new() would store it */
+static char *
+body_bytes(struct file_data *data, int *size)
+{
+	if (data->file_zbuf) {
+		*size = data->file_zsize;
+		return data->file_zbuf;
+	}
+	*size = data->file_size;
+	return data->file_buf;
+}
+
+static struct body_stripe *
+body_stripe(struct cache *cache, unsigned long key)
+{
+	/* the low bits pick the bucket */
+	return &cache->bodies[(key >> 48) % BODY_STRIPES];
+}
+
+/* the caller holds s->lock */
+static struct body *
+body_find(struct body_stripe *s, unsigned long key, struct file_data *data)
+{
+	struct body *body;
+	int size;
+
+	body_bytes(data, &size);
+	for (body = s->bodies[key & s->mask]; body; body = body->next) {
+		if (body->key == key && body->size == size &&
+		    body->file_size == data->file_size &&
+		    body->compressed == (data->file_zbuf != NULL)) {
+			return body;
+		}
+	}
+	return NULL;
+}
+
+/* make a body out of prepared data, laid out like file_new() lays out the
+ * body of a file. a larger body is taken over from data. */
+static struct body *
+body_new(unsigned long key, struct file_data *data)
+{
+	struct body *body;
+	int size;
+	char *buf = body_bytes(data, &size);
+	bool compressed = data->file_zbuf != NULL;
+	bool body_inline = compressed || (!data->file_mapped &&
+					  size <= FILE_INLINE_MAX);
+	size_t block = sizeof(struct body) + (body_inline ? size : 0);
+
+	body = slab_alloc(block);
+	body->key = key;
+	body->size = size;
+	body->file_size = data->file_size;
+	body->charge = slab_charge(body, block);
+	body->compressed = compressed;
+	body->body_inline = body_inline;
+	body->mapped = false;
+	if (body_inline) {
+		body->buf = (char *)(body + 1);
+		if (size > 0) {
+			memcpy(body->buf, buf, size);
+		}
+	} else {
+		body->buf = data->file_buf;
+		body->mapped = data->file_mapped;
+		body->charge += file_data_charge(data);
+		data->file_buf = NULL;
+		data->file_mapped = 0;
+	}
+	body->users = 0;
+	body->charged = NULL;
+	atomic_init(&body->refs, 1);
+	body->next = NULL;
+	return body;
+}
+
+/* the body for prepared data that is about to be cached, with a reference
+ * for the caller: the body of a cached file with the same content if there
+ * is one, else a new one. */
+static struct body *
+body_get(struct cache *cache, struct file_data *data)
+{
+	unsigned long key = body_key(data);
+	struct body_stripe *s = body_stripe(cache, key);
+	struct body *body;
+	int size;
+	char *buf = body_bytes(data, &size);
+
+	pthread_mutex_lock(&s->lock);
+	body = body_find(s, key, data);
+	if (body) {
+		atomic_fetch_add(&body->refs, 1);
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (body) {
+		/* the key is only a checksum. bodies never change, so the
+		 * bytes are compared outside the lock. */
+		if (size == 0 || memcmp(body->buf, buf, size) == 0) {
+			return body;
+		}
+		body_put(body);
+	}
+	return body_new(key, data);
+}
+
+/* the caller holds s->lock */
+static void
+body_resize(struct body_stripe *s, unsigned long buckets)
+{
+	struct body **table = calloc(buckets, sizeof(struct body *));
+	struct body *body, *next;
+	unsigned long i;
+
+	assert(table);
+	for (i = 0; i <= s->mask; i++) {
+		for (body = s->bodies[i]; body; body = next) {
+			next = body->next;
+			body->next = table[body->key & (buckets - 1)];
+			table[body->key & (buckets - 1)] = body;
+		}
+	}
+	free(s->bodies);
+	s->bodies = table;
+	s->mask = buckets - 1;
+}
+
+/* a file that uses body was cached in shard. the first one puts the body in
+ * the table and charges it to shard. the caller holds shard->lock. */
+static void
+body_use(struct cache *cache, struct cache_shard *shard, struct body *body)
+{
+	struct body_stripe *s = body_stripe(cache, body->key);
+
+	pthread_mutex_lock(&s->lock);
+	s->shared_size += body->size;
+	if (body->users++ == 0) {
+		body->next = s->bodies[body->key & s->mask];
+		s->bodies[body->key & s->mask] = body;
+		s->nr_bodies++;
+		s->body_size += body->size;
+		body->charged = shard;
+		atomic_fetch_add(&shard->body_charge, body->charge);
+		if (s->nr_bodies > s->mask + 1) {
+			body_resize(s, (s->mask + 1) * 2);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* a cached file that uses body left the cache. the last one takes the body
+ * out of the table and gives its charge back to the shard that paid it. */
+static void
+body_unuse(struct cache *cache, struct body *body)
+{
+	struct body_stripe *s = body_stripe(cache, body->key);
+	struct body **pp;
+
+	pthread_mutex_lock(&s->lock);
+	s->shared_size -= body->size;
+	if (--body->users == 0) {
+		for (pp = &s->bodies[body->key & s->mask]; *pp != body;
+		     pp = &(*pp)->next);
+		*pp = body->next;
+		body->next = NULL;
+		s->nr_bodies--;
+		s->body_size -= body->size;
+		atomic_fetch_sub(&body->charged->body_charge, body->charge);
+		body->charged = NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* bytes of the shard's budget in use. bodies charged to the shard may be
+ * given back meanwhile by other shards, so this may shrink even while the
+ * caller holds shard->lock. */
+static int
+shard_used(struct cache_shard *shard)
+{
+	return shard->curr_size +
+		atomic_load_explicit(&shard->body_charge, memory_order_relaxed);
+}
+
+/* make a file out of prepared data, with a single reference held by the
+ * caller. it is not in the cache yet, and is used as is to share data that
+ * does not get cached.
+ *
+ * the file, a copy of data, its name and its response header are laid out
+ * in one cache line aligned block, followed by a copy of the body if it is
+ * small, or of the compressed body and its header if it was compressed. a
+ * larger body is taken over from data. data keeps everything else, and the
+ * caller still frees it. if body is not NULL, the file uses that instead of
+ * a body of its own, and takes over the caller's reference to it. */
+static struct file *
+file_new(unsigned long hash, struct file_data *data, struct body *body)
+{
+	struct file *file;
+	struct file_data *fdata;
+	char *p;
+	size_t len = strlen(data->file_name) + 1;
+	size_t size = sizeof(struct file) + sizeof(struct file_data) + len +
+		data->header_size;
+	bool compressed = data->file_zbuf != NULL;
+	bool body_inline = compressed || (!data->file_mapped &&
+					  data->file_size <= FILE_INLINE_MAX);
+
+	if (body) {
+		size += compressed ? data->zheader_size : 0;
+		body_inline = false;
+	} else if (compressed) {
+		/* only the compressed body is kept, always inline */
+		size += data->zheader_size + data->file_zsize;
+	} else if (body_inline) {
+		size += data->file_size;
+	}
+	size = (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+	if (slab_enabled) {
+		/* size classes that are a multiple of a line are aligned */
+		file = slab_alloc(size);
+	} else {
+		file = aligned_alloc(CACHE_LINE, size);
+		assert(file);
+	}
+	p = (char *)(file + 1);
+	fdata = (struct file_data *)p;
+	p += sizeof(struct file_data);
+	*fdata = *data;
+	fdata->file_fd = -1;
+	fdata->file_fd_entry = NULL;
+	fdata->file_name = p;
+	memcpy(p, data->file_name, len);
+	p += len;
+	fdata->header = p;
+	memcpy(p, data->header, data->header_size);
+	p += data->header_size;
+	if (body) {
+		if (compressed) {
+			fdata->zheader = p;
+			memcpy(p, data->zheader, data->zheader_size);
+			fdata->file_zbuf = body->buf;
+			fdata->file_buf = NULL;
+		} else {
+			fdata->file_buf = body->buf;
+		}
+		fdata->file_mapped = 0;
+	} else if (compressed) {
+		fdata->zheader = p;
+		memcpy(p, data->zheader, data->zheader_size);
+		p += data->zheader_size;
+		fdata->file_zbuf = p;
+		memcpy(p, data->file_zbuf, data->file_zsize);
+		fdata->file_buf = NULL;
+		fdata->file_mapped = 0;
+	} else if (body_inline) {
+		if (data->file_size > 0) {
+			memcpy(p, data->file_buf, data->file_size);
+		}
+		fdata->file_buf = p;
+		fdata->file_mapped = 0;
+	} else {
+		/* the body is ours now */
+		data->file_buf = NULL;
+		data->file_mapped = 0;
+	}
+
+	file->hash = hash;
+	file->name = fdata->file_name;
+	file->data = fdata;
+	file->body_inline = body_inline;
+	file->body = body;
+	/* a shared body is charged by body_use() */
+	file->size = slab_charge(file, size);
+	if (!body_inline && !body) {
+		file->size += file_data_charge(fdata);
+	}
+	atomic_init(&file->refs, 1);
+	file->cached = false;
+	atomic_init(&file->changed, false);
+	atomic_init(&file->freq, 0);
+	return file;
+}
+
+/* whether a pinned file is a mapping of a file that has changed since, so
+ * that its body may no longer match its header */
+static bool
+file_changed(struct file *file)
+{
+	return file->data->file_mapped &&
+		atomic_load_explicit(&file->changed, memory_order_relaxed);
+}
+
+static int
+reclaim_high(struct cache_shard *shard)
+{
+	return (long)shard->max_size * RECLAIM_HIGH / 100;
+}
+
+static int
+reclaim_low(struct cache_shard *shard)
+{
+	return (long)shard->max_size * RECLAIM_LOW / 100;
+}
+
+/* with TinyLFU enabled, a new file that would take the shard past its low
+ * watermark is only admitted if it has been requested more often recently
+ * than the file the policy would evict first. the reclaimer brings the shard
+ * back down to that watermark, so every byte cached above it is eventually
+ * paid for by an eviction, even if the shard has room for now. the caller
+ * holds shard->lock. */
+static bool
+cache_admit(struct cache *cache, struct cache_shard *shard,
+	    unsigned long hash, int file_size)
+{
+	struct file *victim;
+
+	if (cache->sketch == NULL ||
+	    shard_used(shard) + file_size <= reclaim_low(shard)) {
+		return true;
+	}
+	victim = cache->policy->peek_victim(shard);
+	return victim == NULL ||
+		sketch_estimate(cache->sketch, hash) >
+		sketch_estimate(cache->sketch, victim->hash);
+}
+
+/* ask the reclaimer to make room in shard, for a file of need bytes if need
+ * is not 0. the caller holds shard->lock. */
+static void
+reclaim_kick(struct cache *cache, struct cache_shard *shard, int need)
+{
+	if (need > shard->reclaim_need) {
+		shard->reclaim_need = need;
+	}
+	if (atomic_exchange(&shard->reclaim, true)) {
+		/* already asked */
+		return;
+	}
+	pthread_mutex_lock(&cache->reclaim_lock);
+	cache->reclaim_kick = true;
+	pthread_cond_signal(&cache->reclaim_cond);
+	pthread_mutex_unlock(&cache->reclaim_lock);
+}
+
+/* bytes that caching file would add to the shard. the caller holds
+ * shard->lock. */
+static int
+file_insert_size(struct cache *cache, struct file *file)
+{
+	struct body_stripe *s;
+	int size = file->size;
+
+	if (file->body) {
+		s = body_stripe(cache, file->body->key);
+		pthread_mutex_lock(&s->lock);
+		if (file->body->users == 0) {
+			size += file->body->charge;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return size;
+}
+
+/* add a new file from file_new() to the shard. on success the hashtable
+ * takes a reference of its own, and the caller keeps its reference. the
+ * caller holds shard->lock.
+ *
+ * nothing is evicted here. if the file is admitted but does not fit, it is
+ * not cached this time, and the reclaimer is asked to make room for it. */
+bool
+cache_insert(struct cache *cache, struct cache_shard *shard,
+	     struct file *file)
+{
+	int size = file_insert_size(cache, file);
+
+	if (cache_lookup(shard, file->hash, file->name) != NULL ||
+	    size > shard->max_size) {
+		return false;
+	}
+	if (!cache_admit(cache, shard, file->hash, size)) {
+		return false;
+	}
+	if (shard->max_size - shard_used(shard) < size) {
+		reclaim_kick(cache, shard, size);
+		return false;
+	}
+	atomic_fetch_add(&file->refs, 1);
+	file->cached = true;
+	shard->curr_size += file->size;
+	shard->data_size += file->data->file_size;
+	if (file->body) {
+		body_use(cache, shard, file->body);
+	}
+	cache->policy->insert(shard, file);
+	/* publishes the fully initialized entry to lock-free readers */
+	cache_index_add(cache, shard, file);
+	shard->nr_files++;
+	if (shard_used(shard) > reclaim_high(shard)) {
+		reclaim_kick(cache, shard, 0);
+	}
+	return true;
+}
+
+/* take a file out of the shard and drop the shard's reference to it. a
+ * reader that pinned the file keeps it alive until it is done sending. the
+ * caller holds shard->lock. */
+static void
+cache_remove(struct cache *cache, struct cache_shard *shard,
+	     struct file *file, bool evicted)
+{
+	cache->policy->remove(shard, file, evicted);
+	file->cached = false;
+	shard->nr_files--;
+	cache_index_delete(cache, shard, file);
+	shard->curr_size -= file->size;
+	shard->data_size -= file->data->file_size;
+	if (file->body) {
+		body_unuse(cache, file->body);
+	}
+	if (evicted && cache->spill && file->data->file_size > 0) {
+		/* the reclaimer copies it to the spill file once it has
+		 * dropped the shard lock */
+		struct spill_item *item = Malloc(sizeof(struct spill_item));
+
+		atomic_fetch_add(&file->refs, 1);
+		item->file = file;
+		item->next = shard->spill_queue;
+		shard->spill_queue = item;
+	}
+	file_put(cache, file);
+}
+
+/* record a hit on a file pinned by the caller */
+static void
+cache_hit(struct cache *cache, struct cache_shard *shard, struct file *file)
+{
+	if (!cache->policy->locked_hit) {
+		cache->policy->hit(shard, file);
+		return;
+	}
+	pthread_mutex_lock(&shard->lock);
+	/* the file may have been evicted since we found it */
+	if (file->cached) {
+		cache->policy->hit(shard, file);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* evict the files chosen by the replacement policy until file_size bytes are
+ * available in the shard. files that are being sent are skipped, and if only
+ * those are left we give up rather than wait for a slow client. evicted files
+ * are only retired, the reclaimer frees them. the caller holds shard->lock. */
+bool
+cache_evict(struct cache *cache, struct cache_shard *shard, int file_size)
+{
+	if (file_size > shard->max_size) {
+		return false;
+	}
+	while ((shard->max_size - shard_used(shard)) < file_size) {
+		struct file *file = cache->policy->victim(shard);
+
+		if (file == NULL) {
+			return false;
+		}
+		cache_remove(cache, shard, file, true);
+	}
+	return true;
+}
+
+/* bring shard back down to its low watermark, or further if a file that was
+ * refused needs more room than that */
+static void
+reclaim_shard(struct cache *cache, struct cache_shard *shard)
+{
+	int room;
+	struct spill_item *queue, *item, *older = NULL;
+	unsigned long generation = 0;
+
+	if (cache->spill) {
+		generation = spill_generation(cache->spill);
+	}
+	pthread_mutex_lock(&shard->lock);
+	room = shard->max_size - reclaim_low(shard);
+	if (shard->reclaim_need > room) {
+		room = shard->reclaim_need;
+	}
+	shard->reclaim_need = 0;
+	cache_evict(cache, shard, room);
+	queue = shard->spill_queue;
+	shard->spill_queue = NULL;
+	pthread_mutex_unlock(&shard->lock);
+
+	/* the queue has the last evicted file first. copy the files in the
+	 * order they were evicted, so that the last ones stay longest. */
+	while (queue) {
+		item = queue;
+		queue = item->next;
+		item->next = older;
+		older = item;
+	}
+	while (older) {
+		item = older;
+		older = item->next;
+		spill_write(cache->spill, item->file, generation);
+		file_put(cache, item->file);
+		free(item);
+	}
+}
+
+static void *
+cache_reclaimer(void *arg)
+{
+	struct cache *cache = arg;
+	int i;
+
+	pthread_mutex_lock(&cache->reclaim_lock);
+	while (!cache->reclaim_exiting) {
+		if (!cache->reclaim_kick) {
+			if (!epoch_pending(&cache->epoch)) {
+				pthread_cond_wait(&cache->reclaim_cond,
+						  &cache->reclaim_lock);
+			} else {
+				/* come back for what readers still hold */
+				struct timespec ts;
+
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_nsec += RECLAIM_INTERVAL_NS;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&cache->reclaim_cond,
+						       &cache->reclaim_lock,
+						       &ts);
+			}
+		}
+		cache->reclaim_kick = false;
+		pthread_mutex_unlock(&cache->reclaim_lock);
+
+		for (i = 0; i < cache->nr_shards; i++) {
+			struct cache_shard *shard = &cache->shards[i];
+
+			if (atomic_exchange(&shard->reclaim, false)) {
+				reclaim_shard(cache, shard);
+			}
+		}
+		epoch_reclaim(&cache->epoch);
+
+		pthread_mutex_lock(&cache->reclaim_lock);
+	}
+	pthread_mutex_unlock(&cache->reclaim_lock);
+	lz_buffer_free();
+	return NULL;
+}
+
+/* return the load of name in progress in shard, or NULL. the caller holds
+ * shard->lock. */
+static struct inflight *
+inflight_find(struct cache_shard *shard, unsigned long hash, char *name)
+{
+	struct inflight *fl;
+
+	for (fl = shard->inflight; fl; fl = fl->next) {
+		if (fl->hash == hash && strcmp(fl->name, name) == 0) {
+			return fl;
+		}
+	}
+	return NULL;
+}
+
+/* announce that the caller is loading name. the caller holds shard->lock. */
+static struct inflight *
+inflight_start(struct cache_shard *shard, unsigned long hash, char *name)
+{
+	struct inflight *fl = Malloc(sizeof(struct inflight));
+
+	fl->hash = hash;
+	fl->name = name;
+	fl->done = false;
+	fl->stale = false;
+	fl->file = NULL;
+	fl->refs = 1;
+	pthread_cond_init(&fl->cond, NULL);
+	fl->next = shard->inflight;
+	shard->inflight = fl;
+	return fl;
+}
+
+static void
+inflight_put(struct inflight *fl)
+{
+	if (--fl->refs == 0) {
+		pthread_cond_destroy(&fl->cond);
+		free(fl);
+	}
+}
+
+/* publish the result of a load, which is NULL if the file could not be read,
+ * and wake up the waiters. the caller holds shard->lock. */
+static void
+inflight_finish(struct cache_shard *shard, struct inflight *fl,
+		struct file *file)
+{
+	struct inflight **pp = &shard->inflight;
+
+	while (*pp != fl) {
+		pp = &(*pp)->next;
+	}
+	*pp = fl->next;
+	fl->done = true;
+	fl->file = file;
+	if (file != NULL) {
+		/* one reference for each waiter */
+		atomic_fetch_add(&file->refs, fl->refs - 1);
+	}
+	pthread_cond_broadcast(&fl->cond);
+	inflight_put(fl);
+}
+
+/* wait for a load started by another request. returns the loaded file, with
+ * a reference for the caller, or NULL if the load failed. the caller holds
+ * shard->lock. */
+static struct file *
+inflight_wait(struct cache_shard *shard, struct inflight *fl)
+{
+	struct file *file;
+
+	fl->refs++;
+	while (!fl->done) {
+		pthread_cond_wait(&fl->cond, &shard->lock);
+	}
+	file = fl->file;
+	inflight_put(fl);
+	return file;
+}
+
+/* invalidation. with a watch, the directories of the files that are cached
+ * are watched with inotify, and a watcher thread drops a file from the cache
+ * as soon as it changes, so that cached files never need to be checked
+ * against the disk. a directory is watched before any file in it is read, so
+ * a change can not be missed between the read and the insert: a load that is
+ * under way when its file changes is not cached.
+ *
+ * the same directory can be spelled in many ways in request names, e.g.
+ * "./dir" and ".//dir". inotify gives them all the same watch descriptor,
+ * and each spelling is kept, so that all the names of a changed file are
+ * found. */
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+		      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		      IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_MIN_BUCKETS 64
+
+struct watch_dir {
+	char *path;		/* as spelled in file names, without the / */
+	unsigned long hash;	/* hashing(path) */
+	int wd;
+	struct watch_dir *hnext;	/* next in the hash chain */
+	struct watch_dir *next;		/* next spelling with the same wd */
+};
+
+struct watch {
+	int fd;				/* the inotify instance */
+	int exit_pipe[2];		/* written to stop the watcher */
+	pthread_t thread;
+	pthread_mutex_t lock;		/* protects the fields below */
+	struct watch_dir **table;	/* chained hashtable of dirs */
+	unsigned long mask;		/* buckets - 1 */
+	long nr_dirs;
+	struct watch_dir **by_wd;	/* spellings of each wd */
+	int nr_wds;			/* size of by_wd */
+	long events;
+	long invalidated;		/* files dropped from the cache */
+	bool full;			/* ran out of inotify watches */
+};
+
+/* the caller holds w->lock */
+static struct watch_dir *
+watch_find(struct watch *w, unsigned long hash, const char *path)
+{
+	struct watch_dir *d;
+
+	for (d = w->table[hash & w->mask]; d; d = d->hnext) {
+		if (d->hash == hash && strcmp(d->path, path) == 0) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+/* the caller holds w->lock */
+static void
+watch_resize(struct watch *w, unsigned long buckets)
+{
+	struct watch_dir **table = calloc(buckets, sizeof(struct watch_dir *));
+	struct watch_dir *d, *next;
+	unsigned long i;
+
+	assert(table);
+	for (i = 0; i <= w->mask; i++) {
+		for (d = w->table[i]; d; d = next) {
+			next = d->hnext;
+			d->hnext = table[d->hash & (buckets - 1)];
+			table[d->hash & (buckets - 1)] = d;
+		}
+	}
+	free(w->table);
+	w->table = table;
+	w->mask = buckets - 1;
+}
+
+/* make sure the directory of the file name is watched. returns false if it
+ * can not be, and then the file must not be cached. */
+static bool
+watch_file(struct watch *w, const char *name)
+{
+	char path[MAXLINE];
+	const char *slash = strrchr(name, '/');
+	struct watch_dir *d;
+	unsigned long hash;
+	int wd;
+
+	/* request names always have a directory, at least "." */
+	if (slash == NULL || slash - name >= MAXLINE) {
+		return false;
+	}
+	memcpy(path, name, slash - name);
+	path[slash - name] = 0;
+	hash = hashing(path);
+	pthread_mutex_lock(&w->lock);
+	if (watch_find(w, hash, path) != NULL) {
+		pthread_mutex_unlock(&w->lock);
+		return true;
+	}
+	wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno == ENOSPC && !w->full) {
+			w->full = true;
+			fprintf(stderr, "watch: out of inotify watches, "
+				"files in %s and other directories are not "
+				"cached\n", path);
+		}
+		pthread_mutex_unlock(&w->lock);
+		return false;
+	}
+	if (wd >= w->nr_wds) {
+		int nr_wds = w->nr_wds;
+
+		while (wd >= w->nr_wds) {
+			w->nr_wds *= 2;
+		}
+		w->by_wd = realloc(w->by_wd,
+				   sizeof(struct watch_dir *) * w->nr_wds);
+		assert(w->by_wd);
+		memset(w->by_wd + nr_wds, 0,
+		       sizeof(struct watch_dir *) * (w->nr_wds - nr_wds));
+	}
+	d = Malloc(sizeof(struct watch_dir));
+	d->path = strdup(path);
+	assert(d->path);
+	d->hash = hash;
+	d->wd = wd;
+	d->hnext = w->table[hash & w->mask];
+	w->table[hash & w->mask] = d;
+	d->next = w->by_wd[wd];
+	w->by_wd[wd] = d;
+	w->nr_dirs++;
+	if (w->nr_dirs > (long)w->mask + 1) {
+		watch_resize(w, (w->mask + 1) * 2);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return true;
+}
+
+/* forget the spellings of a watch that inotify removed, so that the next
+ * miss in the directory watches it again. the caller holds w->lock. */
+static void
+watch_forget(struct watch *w, int wd)
+{
+	struct watch_dir *d, **pp;
+
+	while ((d = w->by_wd[wd]) != NULL) {
+		w->by_wd[wd] = d->next;
+		for (pp = &w->table[d->hash & w->mask]; *pp != d;
+		     pp = &(*pp)->hnext);
+		*pp = d->hnext;
+		w->nr_dirs--;
+		free(d->path);
+		free(d);
+	}
+}
+
+/* drop the files in shard whose names match because they changed. loads of
+ * them that are under way are not cached, and evicted ones are not spilled.
+ * the caller holds shard->lock. returns the number of files dropped. */
+static long
+shard_invalidate(struct cache *cache, struct cache_shard *shard,
+		 const char *prefix, size_t len)
+{
+	struct spill_item **pp, *item;
+	struct inflight *fl;
+	struct file *file, **files;
+	struct cache_index *t;
+	unsigned long i;
+	long nr = 0;
+
+	for (fl = shard->inflight; fl; fl = fl->next) {
+		if (name_matches(fl->name, prefix, len)) {
+			fl->stale = true;
+		}
+	}
+	for (pp = &shard->spill_queue; (item = *pp) != NULL;) {
+		if (name_matches(item->file->name, prefix, len)) {
+			*pp = item->next;
+			file_put(cache, item->file);
+			free(item);
+		} else {
+			pp = &item->next;
+		}
+	}
+	if (len == strlen(prefix) + 1) {
+		/* a single file */
+		file = cache_lookup(shard, hashing((char *)prefix),
+				    (char *)prefix);
+		if (file != NULL) {
+			atomic_store(&file->changed, true);
+			cache_remove(cache, shard, file, false);
+			nr++;
+		}
+		return nr;
+	}
+	/* removing files changes the table, so find them all first */
+	index_migrate(cache, shard, ~0UL);
+	t = atomic_load(&shard->index);
+	files = Malloc(sizeof(struct file *) * (shard->nr_files + 1));
+	for (i = 0; i <= t->mask; i++) {
+		file = atomic_load(&t->slots[i].file);
+		if (file != NULL && name_matches(file->name, prefix, len)) {
+			files[nr++] = file;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		atomic_store(&files[i]->changed, true);
+		cache_remove(cache, shard, files[i], false);
+	}
+	free(files);
+	return nr;
+}
+
+/* drop the files whose names match from every tier of the cache. returns
+ * the number of files dropped from memory. */
+static long
+cache_invalidate(struct cache *cache, const char *prefix, size_t len)
+{
+	struct cache_shard *shard;
+	long nr = 0;
+	int i;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		shard = &cache->shards[i];
+		if (len == strlen(prefix) + 1 &&
+		    shard != cache_shard(cache, hashing((char *)prefix))) {
+			/* a single file, which can only be in one shard */
+			continue;
+		}
+		pthread_mutex_lock(&shard->lock);
+		nr += shard_invalidate(cache, shard, prefix, len);
+		pthread_mutex_unlock(&shard->lock);
+	}
+	if (cache->spill) {
+		spill_invalidate(cache->spill, prefix, len);
+	}
+	request_forget_stat(prefix, len);
+	return nr;
+}
+
+static void
+watch_event(struct cache *cache, struct inotify_event *ev)
+{
+	struct watch *w = cache->watch;
+	char path[MAXLINE];
+	struct watch_dir *d;
+
+	pthread_mutex_lock(&w->lock);
+	w->events++;
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost, so anything may have changed */
+		w->invalidated += cache_invalidate(cache, "", 0);
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= w->nr_wds) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	for (d = w->by_wd[ev->wd]; d; d = d->next) {
+		if (ev->len > 0) {
+			/* a file in the directory */
+			snprintf(path, sizeof(path), "%s/%s", d->path,
+				 ev->name);
+			w->invalidated += cache_invalidate(cache, path,
+							   strlen(path) + 1);
+		} else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+			/* the directory itself, and all below it */
+			snprintf(path, sizeof(path), "%s/", d->path);
+			w->invalidated += cache_invalidate(cache, path,
+							   strlen(path));
+		}
+	}
+	if (ev->mask & IN_MOVE_SELF) {
+		/* its names now lead somewhere else */
+		inotify_rm_watch(w->fd, ev->wd);
+	}
+	if (ev->mask & IN_IGNORED) {
+		watch_forget(w, ev->wd);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *
+watch_thread(void *arg)
+{
+	struct cache *cache = arg;
+	struct watch *w = cache->watch;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[] = {
+		{w->exit_pipe[0], POLLIN},
+		{w->fd, POLLIN},
+	};
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while (1) {
+		SYS(poll(fds, 2, -1));
+		if (fds[0].revents & POLLIN) {
+			break;
+		}
+		n = read(w->fd, buf, sizeof(buf));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		SYS(n);
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			watch_event(cache, ev);
+		}
+	}
+	return NULL;
+}
+
+static void
+watch_start(struct cache *cache)
+{
+	struct watch *w = Malloc(sizeof(struct watch));
+
+	SYS(w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+	SYS(pipe(w->exit_pipe));
+	pthread_mutex_init(&w->lock, NULL);
+	w->mask = WATCH_MIN_BUCKETS - 1;
+	w->table = calloc(WATCH_MIN_BUCKETS, sizeof(struct watch_dir *));
+	assert(w->table);
+	w->nr_dirs = 0;
+	w->nr_wds = WATCH_MIN_BUCKETS;
+	w->by_wd = calloc(w->nr_wds, sizeof(struct watch_dir *));
+	assert(w->by_wd);
+	w->events = 0;
+	w->invalidated = 0;
+	w->full = false;
+	cache->watch = w;
+	SYS(pthread_create(&w->thread, NULL, watch_thread, cache));
+}
+
+static void
+watch_stop(struct cache *cache)
+{
+	struct watch *w = cache->watch;
+	int i;
+
+	Rio_write(w->exit_pipe[1], "x", 1);
+	pthread_join(w->thread, NULL);
+	for (i = 0; i < w->nr_wds; i++) {
+		watch_forget(w, i);
+	}
+	SYS(close(w->fd));
+	SYS(close(w->exit_pipe[0]));
+	SYS(close(w->exit_pipe[1]));
+	free(w->table);
+	free(w->by_wd);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+	cache->watch = NULL;
+}
+
+static void
+watch_print_stats(struct watch *w, FILE *out)
+{
+	pthread_mutex_lock(&w->lock);
+	fprintf(out, "watch: %ld directories, %ld events, %ld files "
+		"invalidated\n", w->nr_dirs, w->events, w->invalidated);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* preloading. the files listed in a fileset index are read into the cache
+ * at startup by background threads, while the server already accepts
+ * connections. after the number of files, the index has a line per file,
+ * "name csum size", and may give the file a priority as a fourth field.
+ * files are loaded highest priority first, and in index order otherwise,
+ * until the cache is filled to its high watermark, so that the reclaimer
+ * does not evict any of them right away. their checksums are taken from the
+ * index. a request for a file that is being preloaded waits for it like for
+ * any other miss. */
+struct preload_entry {
+	char *name;		/* as in the index */
+	unsigned int csum;
+	int size;
+	long priority;
+	int pos;		/* in the index */
+};
+
+struct preload {
+	struct cache *cache;
+	struct preload_entry *entries;	/* in the order they are loaded */
+	int nr_entries;
+	atomic_int next;		/* next entry to load */
+	atomic_long bytes;		/* loaded, or being loaded */
+	long budget;
+	atomic_bool stop;
+	int nr_threads;
+	pthread_t *threads;
+	atomic_long loaded;
+	atomic_long skipped;		/* changed, cached, or no room */
+};
+
+static int
+preload_entry_cmp(const void *a, const void *b)
+{
+	const struct preload_entry *x = a, *y = b;
+
+	if (x->priority != y->priority) {
+		return x->priority > y->priority ? -1 : 1;
+	}
+	return x->pos - y->pos;
+}
+
+/* read a fileset index. returns the number of entries read into *entries,
+ * or -1 if the index cannot be read. */
+static int
+preload_read_index(const char *path, struct preload_entry **entries)
+{
+	char buf[MAXLINE], name[MAXLINE];
+	struct preload_entry *e;
+	FILE *f;
+	int nr, i;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "preload %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), f) == NULL || (nr = atoi(buf)) <= 0) {
+		fprintf(stderr, "preload %s: not a fileset index\n", path);
+		fclose(f);
+		return -1;
+	}
+	*entries = Malloc(sizeof(struct preload_entry) * nr);
+	for (i = 0; i < nr && fgets(buf, sizeof(buf), f); i++) {
+		e = &(*entries)[i];
+		e->priority = 0;
+		if (sscanf(buf, "%s %u %d %ld", name, &e->csum, &e->size,
+			   &e->priority) < 3 || e->size < 0) {
+			fprintf(stderr, "preload %s: bad line %d\n", path,
+				i + 2);
+			break;
+		}
+		e->name = strdup(name);
+		assert(e->name);
+		e->pos = i;
+	}
+	fclose(f);
+	qsort(*entries, i, sizeof(struct preload_entry), preload_entry_cmp);
+	return i;
+}
+
+/* load a file listed in the index, as a miss would. returns true if it was
+ * cached. */
+static bool
+preload_file(struct cache *cache, struct preload_entry *e)
+{
+	struct file_data *data = file_data_init();
+	struct cache_shard *shard;
+	struct inflight *fl;
+	struct file *file;
+	unsigned long hash;
+	bool cached = false;
+
+	request_set_file_name(data, e->name);
+	hash = hashing(data->file_name);
+	shard = cache_shard(cache, hash);
+	pthread_mutex_lock(&shard->lock);
+	if (cache_lookup(shard, hash, data->file_name) != NULL ||
+	    inflight_find(shard, hash, data->file_name) != NULL ||
+	    shard_used(shard) + e->size > reclaim_high(shard)) {
+		pthread_mutex_unlock(&shard->lock);
+		file_data_free(data);
+		return false;
+	}
+	fl = inflight_start(shard, hash, data->file_name);
+	pthread_mutex_unlock(&shard->lock);
+
+	if ((cache->watch && !watch_file(cache->watch, data->file_name)) ||
+	    !request_loadfile(data, e->size)) {
+		pthread_mutex_lock(&shard->lock);
+		inflight_finish(shard, fl, NULL);
+		pthread_mutex_unlock(&shard->lock);
+		file_data_free(data);
+		return false;
+	}
+	request_prepare_checked(data, e->csum);
+	if (cache->compress) {
+		file_data_compress(data);
+	}
+	file = file_new(hash, data,
+			cache->dedup ? body_get(cache, data) : NULL);
+	pthread_mutex_lock(&shard->lock);
+	if (!fl->stale && shard_used(shard) + file_insert_size(cache, file) <=
+	    reclaim_high(shard)) {
+		cached = cache_insert(cache, shard, file);
+	}
+	inflight_finish(shard, fl, file);
+	pthread_mutex_unlock(&shard->lock);
+	file_put(cache, file);
+	file_data_free(data);
+	return cached;
+}
+
+static void *
+preload_thread(void *arg)
+{
+	struct preload *pl = arg;
+	int i;
+
+	while (!atomic_load(&pl->stop) &&
+	       (i = atomic_fetch_add(&pl->next, 1)) < pl->nr_entries) {
+		struct preload_entry *e = &pl->entries[i];
+
+		/* a smaller file further down may still fit */
+		if (atomic_fetch_add(&pl->bytes, e->size) + e->size >
+		    pl->budget || !preload_file(pl->cache, e)) {
+			atomic_fetch_sub(&pl->bytes, e->size);
+			atomic_fetch_add(&pl->skipped, 1);
+			continue;
+		}
+		atomic_fetch_add(&pl->loaded, 1);
+	}
+	return NULL;
+}
+
+/* start preloading the files listed in the index at path */
+static void
+preload_start(struct cache *cache, const char *path, int nr_threads)
+{
+	struct preload *pl;
+	int i;
+
+	pl = Malloc(sizeof(struct preload));
+	pl->cache = cache;
+	pl->nr_entries = preload_read_index(path, &pl->entries);
+	if (pl->nr_entries < 0) {
+		free(pl);
+		return;
+	}
+	atomic_init(&pl->next, 0);
+	atomic_init(&pl->bytes, 0);
+	pl->budget = 0;
+	for (i = 0; i < cache->nr_shards; i++) {
+		pl->budget += reclaim_high(&cache->shards[i]);
+	}
+	atomic_init(&pl->stop, false);
+	atomic_init(&pl->loaded, 0);
+	atomic_init(&pl->skipped, 0);
+	pl->nr_threads = nr_threads > 0 ? nr_threads : 1;
+	pl->threads = Malloc(sizeof(pthread_t) * pl->nr_threads);
+	for (i = 0; i < pl->nr_threads; i++) {
+		SYS(pthread_create(&pl->threads[i], NULL, preload_thread, pl));
+	}
+	cache->preload = pl;
+}
+
+/* stop preloading, if it is not done yet, and keep its statistics */
+static void
+preload_stop(struct cache *cache)
+{
+	struct preload *pl = cache->preload;
+	int i;
+
+	if (pl == NULL) {
+		return;
+	}
+	atomic_store(&pl->stop, true);
+	for (i = 0; i < pl->nr_threads; i++) {
+		pthread_join(pl->threads[i], NULL);
+	}
+	cache->preload_loaded = atomic_load(&pl->loaded);
+	cache->preload_skipped = atomic_load(&pl->skipped);
+	for (i = 0; i < pl->nr_entries; i++) {
+		free(pl->entries[i].name);
+	}
+	free(pl->entries);
+	free(pl->threads);
+	free(pl);
+	cache->preload = NULL;
+}
+
+/* the memory pressure monitor. every PRESSURE_INTERVAL seconds it looks at
+ * how much of the last 10 seconds some task spent stalled waiting for
+ * memory, from PSI, and at how close the server's memory cgroup is to its
+ * limit, not counting page cache that the kernel can drop. under pressure
+ * the cache budget shrinks by an eighth, but not below an eighth of
+ * max_cache_size, and the reclaimer evicts down to the shards' new
+ * watermarks. once pressure clears, the budget grows back by a 32nd of
+ * max_cache_size at a time. PSI is read from the cgroup's memory.pressure
+ * if it has one, else from /proc/pressure/memory. without PSI or a cgroup
+ * limit, that signal is simply not used. */
+#define PRESSURE_INTERVAL 1	/* seconds between checks */
+#define PRESSURE_HIGH 10.0	/* % of time stalled that shrinks the cache */
+#define PRESSURE_LOW 1.0	/* and under which it may grow */
+#define PRESSURE_HEADROOM 10	/* % of the cgroup limit to keep free */
+#define PRESSURE_SHRINK 8	/* shrink by 1/8 of the budget */
+#define PRESSURE_GROW 32	/* grow by 1/32 of max_cache_size */
+#define PRESSURE_MIN 8		/* down to 1/8 of max_cache_size */
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+struct pressure {
+	char *psi;		/* PSI file, or NULL */
+	char *limit;		/* memory cgroup limit file, or NULL */
+	char *usage;		/* and its usage, in bytes */
+	char *stat;		/* and its memory.stat */
+	const char *inactive;	/* memory.stat key of inactive page cache */
+	pthread_t thread;
+	pthread_mutex_t lock;	/* protects the fields below */
+	pthread_cond_t cond;	/* signalled when exiting is set */
+	bool exiting;
+	double stalled;		/* last PSI some avg10 */
+	long lowest;		/* smallest budget so far */
+	long shrinks;
+	long grows;
+};
+
+/* give the shards budget bytes between them, like cache_init() does.
+ * shards that are over their new high watermark are reclaimed. */
+static void
+cache_set_budget(struct cache *cache, long budget)
+{
+	int i;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		atomic_store_explicit(&shard->max_size,
+				      budget / cache->nr_shards +
+				      (i < budget % cache->nr_shards),
+				      memory_order_relaxed);
+		if (shard_used(shard) > reclaim_high(shard)) {
+			reclaim_kick(cache, shard, 0);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	atomic_store(&cache->budget, budget);
+}
+
+/* copy what follows key at the start of a line of path to value. returns
+ * false if there is no such line. */
+static bool
+pressure_read(const char *path, const char *key, char *value, size_t size)
+{
+	char line[MAXLINE];
+	size_t len = strlen(key);
+	bool found = false;
+	FILE *f;
+
+	if (path == NULL || (f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, len) == 0) {
+			snprintf(value, size, "%s", line + len);
+			found = true;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+/* dir/name, if it can be read, or NULL */
+static char *
+pressure_file(const char *dir, const char *name)
+{
+	char path[MAXLINE];
+	char *p;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (access(path, R_OK) < 0) {
+		return NULL;
+	}
+	p = strdup(path);
+	assert(p);
+	return p;
+}
+
+/* find the files of the server's memory cgroup. /proc/self/cgroup has a
+ * line "0::path" for cgroup v2, or "id:controllers:path" for each v1
+ * hierarchy. in a cgroup namespace, the cgroup is mounted at the root. */
+static void
+pressure_find_cgroup(struct pressure *p)
+{
+	char line[MAXLINE], dir[MAXLINE];
+	char *controllers, *path;
+	bool v2;
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL) {
+		return;
+	}
+	while (p->limit == NULL && fgets(line, sizeof(line), f)) {
+		controllers = strchr(line, ':');
+		path = controllers ? strchr(controllers + 1, ':') : NULL;
+		if (path == NULL) {
+			continue;
+		}
+		*path++ = 0;
+		path[strcspn(path, "\n")] = 0;
+		controllers++;
+		v2 = *controllers == 0;
+		if (!v2 && !name_matches(controllers, "memory", 7) &&
+		    strstr(controllers, "memory,") == NULL &&
+		    strstr(controllers, ",memory") == NULL) {
+			continue;
+		}
+		for (i = 0; i < 2 && p->limit == NULL; i++) {
+			snprintf(dir, sizeof(dir), "%s%s%s", CGROUP_ROOT,
+				 v2 ? "" : "/memory", i == 0 ? path : "");
+			if (v2) {
+				p->limit = pressure_file(dir, "memory.max");
+				p->usage = pressure_file(dir,
+						"memory.current");
+				p->inactive = "inactive_file ";
+				free(p->psi);
+				p->psi = pressure_file(dir,
+						"memory.pressure");
+			} else {
+				p->limit = pressure_file(dir,
+						"memory.limit_in_bytes");
+				p->usage = pressure_file(dir,
+						"memory.usage_in_bytes");
+				p->inactive = "total_inactive_file ";
+			}
+			p->stat = pressure_file(dir, "memory.stat");
+			if (p->limit && p->usage) {
+				break;
+			}
+			free(p->limit);
+			free(p->usage);
+			free(p->stat);
+			p->limit = p->usage = p->stat = NULL;
+		}
+	}
+	fclose(f);
+}
+
+/* is the cgroup within PRESSURE_HEADROOM of its limit? returns 1 if it is,
+ * -1 if it is within twice that, and 0 if it is well clear of it or has no
+ * limit that we know of. */
+static int
+pressure_cgroup(struct pressure *p)
+{
+	char value[64];
+	long long limit, used, inactive = 0;
+
+	if (!pressure_read(p->limit, "", value, sizeof(value))) {
+		return 0;
+	}
+	/* "max" for none in cgroup v2 */
+	limit = strtoll(value, NULL, 10);
+	if (limit <= 0 ||
+	    !pressure_read(p->usage, "", value, sizeof(value))) {
+		return 0;
+	}
+	used = strtoll(value, NULL, 10);
+	if (pressure_read(p->stat, p->inactive, value, sizeof(value))) {
+		inactive = strtoll(value, NULL, 10);
+	}
+	used -= inactive;
+	if (limit - used < limit / 100 * PRESSURE_HEADROOM) {
+		return 1;
+	}
+	return limit - used < limit / 100 * PRESSURE_HEADROOM * 2 ? -1 : 0;
+}
+
+static void
+pressure_check(struct cache *cache, struct pressure *p)
+{
+	char value[64];
+	double stalled = 0;
+	long max = cache->max_cache_size;
+	long budget = atomic_load(&cache->budget);
+	long next = budget;
+	long lowest = max / PRESSURE_MIN;
+	int cgroup;
+
+	if (pressure_read(p->psi, "some avg10=", value, sizeof(value))) {
+		stalled = strtod(value, NULL);
+	}
+	cgroup = pressure_cgroup(p);
+	if (lowest < cache->nr_shards) {
+		lowest = cache->nr_shards;
+	}
+	if (stalled >= PRESSURE_HIGH || cgroup == 1) {
+		next = budget - budget / PRESSURE_SHRINK;
+		if (next < lowest) {
+			next = lowest;
+		}
+	} else if (stalled < PRESSURE_LOW && cgroup == 0) {
+		next = budget + max / PRESSURE_GROW;
+		if (next > max) {
+			next = max;
+		}
+	}
+	pthread_mutex_lock(&p->lock);
+	p->stalled = stalled;
+	if (next < budget) {
+		p->shrinks++;
+	} else if (next > budget) {
+		p->grows++;
+	}
+	if (next < p->lowest) {
+		p->lowest = next;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (next != budget) {
+		cache_set_budget(cache, next);
+		fprintf(stderr, "cache budget %ld of %ld bytes, memory "
+			"stalls %.2f%%\n", next, max, stalled);
+	}
+}
+
+static void *
+pressure_thread(void *arg)
+{
+	struct cache *cache = arg;
+	struct pressure *p = cache->pressure;
+	struct timespec ts;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += PRESSURE_INTERVAL;
+		pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+		if (p->exiting) {
+			break;
+		}
+		pthread_mutex_unlock(&p->lock);
+		pressure_check(cache, p);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void
+pressure_start(struct cache *cache)
+{
+	struct pressure *p = Malloc(sizeof(struct pressure));
+
+	p->limit = p->usage = p->stat = p->psi = NULL;
+	p->inactive = NULL;
+	pressure_find_cgroup(p);
+	if (p->psi == NULL) {
+		p->psi = pressure_file("/proc/pressure", "memory");
+	}
+	if (p->psi == NULL && p->limit == NULL) {
+		fprintf(stderr, "memory pressure: no PSI or memory cgroup "
+			"found, the cache budget stays fixed\n");
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->exiting = false;
+	p->stalled = 0;
+	p->lowest = cache->max_cache_size;
+	p->shrinks = 0;
+	p->grows = 0;
+	cache->pressure = p;
+	SYS(pthread_create(&p->thread, NULL, pressure_thread, cache));
+}
+
+static void
+pressure_stop(struct cache *cache)
+{
+	struct pressure *p = cache->pressure;
+
+	pthread_mutex_lock(&p->lock);
+	p->exiting = true;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->psi);
+	free(p->limit);
+	free(p->usage);
+	free(p->stat);
+	free(p);
+	cache->pressure = NULL;
+}
+
+static void
+pressure_print_stats(struct cache *cache, FILE *out)
+{
+	struct pressure *p = cache->pressure;
+
+	pthread_mutex_lock(&p->lock);
+	fprintf(out, "pressure: budget %ld of %d bytes, lowest %ld, "
+		"%ld shrinks, %ld grows, memory stalls %.2f%%\n",
+		atomic_load(&cache->budget), cache->max_cache_size,
+		p->lowest, p->shrinks, p->grows, p->stalled);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* miss ratio curve estimation. a file is sampled if the low bits of a remix
+ * of its name hash are below a threshold, so about threshold / MRC_MODULUS
+ * of the files are sampled, and all the requests for them (SHARDS spatial
+ * sampling). for each request for a sampled file, we find its reuse
+ * distance: the bytes of the distinct sampled files requested since the
+ * previous request for it, itself included. scaled up by the sampling rate,
+ * that is the smallest LRU cache that would have had the file. a histogram
+ * of the distances, plus the first requests that no cache can hit, gives
+ * the miss ratio of any cache size.
+ *
+ * the distance is a sum over a Fenwick tree of file sizes indexed by the
+ * time of each file's last request, where time counts sampled requests.
+ * when time runs out the files are renumbered in order. no more than
+ * MRC_MAX_FILES files are tracked: when there would be more, the threshold
+ * is halved and the files that are no longer sampled are dropped. each
+ * request counts 1 / rate, so counts made at the old rate stay comparable.
+ *
+ * so that sampled requests do not all take one lock, the files are split by
+ * another remix of their hash into MRC_STRIPES stripes, which sample and
+ * track their own files under their own lock. a stripe is itself a spatial
+ * sample of 1 in MRC_STRIPES files, so its distances are scaled up by that
+ * too, and the stripes' histograms add up to that of the whole stream.
+ *
+ * with a few popular files, whether they happen to be sampled skews the
+ * estimate a lot. so, as in SHARDS-adj, the misses are divided by the
+ * number of requests that were made, rather than that the sample suggests,
+ * which amounts to counting the difference as hits.
+ *
+ * requests for files that are not sampled only count the request in their
+ * stripe and compute remixes of the hash they already have, and take no
+ * lock. */
+#define MRC_MODULUS (1UL << 24)
+#define MRC_RATE 10		/* sample 1 in MRC_RATE files at first */
+#define MRC_STRIPES 16
+#define MRC_MAX_FILES 512	/* per stripe */
+#define MRC_TIMES (4 * MRC_MAX_FILES)	/* Fenwick tree size */
+#define MRC_BUCKETS 188		/* 4 per power of two, up to 2^48 */
+
+struct mrc_file {
+	unsigned long hash;
+	int size;
+	int time;		/* of its last request, 1 to MRC_TIMES */
+	struct mrc_file *next;	/* in the hash chain */
+};
+
+struct mrc_stripe {
+	atomic_ulong threshold;	/* files below it are sampled */
+	atomic_long requests;	/* all of them */
+	pthread_mutex_t lock;	/* protects the fields below */
+	struct mrc_file **table;	/* MRC_MAX_FILES buckets */
+	int nr_files;
+	int time;		/* last time given out */
+	long long *tree;	/* Fenwick tree of sizes, by time */
+	double hist[MRC_BUCKETS];	/* requests, by reuse distance */
+	double cold;		/* first requests for a file */
+	double total;
+	long sampled;		/* requests that were sampled */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct mrc {
+	struct mrc_stripe stripes[MRC_STRIPES];
+};
+
+static unsigned long
+mrc_sample(unsigned long hash)
+{
+	/* independent of the bits that pick the shard and the slot */
+	return (hash * 0xbf58476d1ce4e5b9UL >> 40) % MRC_MODULUS;
+}
+
+static struct mrc_stripe *
+mrc_stripe(struct mrc *m, unsigned long hash)
+{
+	/* and of those that mrc_sample() looks at */
+	return &m->stripes[(hash * 0x94d049bb133111ebUL >> 32) % MRC_STRIPES];
+}
+
+/* histogram bucket of a distance of d bytes */
+static int
+mrc_bucket(unsigned long d)
+{
+	int o;
+
+	if (d < 4) {
+		return d;
+	}
+	o = 63 - __builtin_clzl(d);
+	if (o >= 48) {
+		return MRC_BUCKETS - 1;
+	}
+	return (o - 1) * 4 + ((d >> (o - 2)) & 3);
+}
+
+/* the smallest distance in bucket b */
+static unsigned long
+mrc_bucket_start(int b)
+{
+	if (b < 4) {
+		return b;
+	}
+	return (4UL + b % 4) << (b / 4 - 1);
+}
+
+static void
+mrc_tree_add(struct mrc_stripe *s, int time, long long size)
+{
+	for (; time <= MRC_TIMES; time += time & -time) {
+		s->tree[time] += size;
+	}
+}
+
+/* bytes of the files last requested at or before time */
+static long long
+mrc_tree_sum(struct mrc_stripe *s, int time)
+{
+	long long sum = 0;
+
+	for (; time > 0; time -= time & -time) {
+		sum += s->tree[time];
+	}
+	return sum;
+}
+
+static struct mrc_file **
+mrc_find(struct mrc_stripe *s, unsigned long hash)
+{
+	struct mrc_file **pp;
+
+	for (pp = &s->table[hash % MRC_MAX_FILES]; *pp;
+	     pp = &(*pp)->next) {
+		if ((*pp)->hash == hash) {
+			break;
+		}
+	}
+	return pp;
+}
+
+static int
+mrc_time_cmp(const void *a, const void *b)
+{
+	const struct mrc_file *fa = *(struct mrc_file **)a;
+	const struct mrc_file *fb = *(struct mrc_file **)b;
 
-struct server {
-	int nr_threads; 
-	int max_requests; 
-	int max_cache_size; 
-	int exiting;
+	return fa->time - fb->time;
+}
 
-        int *conn_buf; 
-        pthread_t *threads;
-        int request_head;
-        int request_tail;
-        pthread_mutex_t mutex;
-	pthread_cond_t prod_cond;
-	pthread_cond_t cons_cond;
-        
-	struct cache *web_cache;
-};
+/* give the files times 1 to nr_files, in the same order */
+static void
+mrc_renumber(struct mrc_stripe *s)
+{
+	struct mrc_file **files, *f;
+	int i, n = 0;
 
-struct queue {
-    int hash_value;
-    struct queue* next;
-};
+	files = Malloc(sizeof(struct mrc_file *) * (s->nr_files + 1));
+	for (i = 0; i < MRC_MAX_FILES; i++) {
+		for (f = s->table[i]; f; f = f->next) {
+			files[n++] = f;
+		}
+	}
+	qsort(files, n, sizeof(struct mrc_file *), mrc_time_cmp);
+	memset(s->tree, 0, sizeof(long long) * (MRC_TIMES + 1));
+	for (i = 0; i < n; i++) {
+		files[i]->time = i + 1;
+		mrc_tree_add(s, i + 1, files[i]->size);
+	}
+	s->time = n;
+	free(files);
+}
 
-struct file {
-	char *name;
-	struct file_data *data;
-};
+/* halve the sampling rate, and forget the files it no longer samples */
+static void
+mrc_lower_rate(struct mrc_stripe *s)
+{
+	unsigned long threshold = atomic_load(&s->threshold) / 2;
+	struct mrc_file **pp, *f;
+	int i;
 
-struct cache {
-	int curr_size;
-	int max_size;
-	int hashtable_size;
-	struct queue *LRU;
-	struct file **hashtable; 
+	atomic_store(&s->threshold, threshold);
+	for (i = 0; i < MRC_MAX_FILES; i++) {
+		for (pp = &s->table[i]; (f = *pp) != NULL;) {
+			if (mrc_sample(f->hash) < threshold) {
+				pp = &f->next;
+				continue;
+			}
+			*pp = f->next;
+			mrc_tree_add(s, f->time, -f->size);
+			s->nr_files--;
+			free(f);
+		}
+	}
+}
+
+static struct mrc *
+mrc_init(void)
+{
+	struct mrc *m = aligned_alloc(CACHE_LINE, sizeof(struct mrc));
+	int i, b;
+
+	assert(m);
+	for (i = 0; i < MRC_STRIPES; i++) {
+		struct mrc_stripe *s = &m->stripes[i];
+
+		atomic_init(&s->threshold, MRC_MODULUS / MRC_RATE);
+		atomic_init(&s->requests, 0);
+		pthread_mutex_init(&s->lock, NULL);
+		s->table = calloc(MRC_MAX_FILES, sizeof(struct mrc_file *));
+		assert(s->table);
+		s->nr_files = 0;
+		s->time = 0;
+		s->tree = calloc(MRC_TIMES + 1, sizeof(long long));
+		assert(s->tree);
+		for (b = 0; b < MRC_BUCKETS; b++) {
+			s->hist[b] = 0;
+		}
+		s->cold = 0;
+		s->total = 0;
+		s->sampled = 0;
+	}
+	return m;
+}
+
+/* account for a request for a file of size bytes */
+static void
+mrc_access(struct mrc *m, unsigned long hash, int size)
+{
+	struct mrc_stripe *s = mrc_stripe(m, hash);
+	unsigned long threshold;
+	struct mrc_file *f;
+	double weight;
+	long long d;
+
+	atomic_fetch_add_explicit(&s->requests, 1, memory_order_relaxed);
+	threshold = atomic_load_explicit(&s->threshold,
+					 memory_order_relaxed);
+	if (mrc_sample(hash) >= threshold) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	/* the rate may have been lowered meanwhile */
+	threshold = atomic_load(&s->threshold);
+	if (mrc_sample(hash) >= threshold) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	weight = (double)MRC_MODULUS / threshold;
+	s->sampled++;
+	s->total += weight;
+	if (s->time == MRC_TIMES) {
+		mrc_renumber(s);
+	}
+	f = *mrc_find(s, hash);
+	if (f != NULL) {
+		d = mrc_tree_sum(s, s->time) - mrc_tree_sum(s, f->time) +
+			size;
+		s->hist[mrc_bucket((unsigned long)(d * weight *
+						   MRC_STRIPES))] += weight;
+		mrc_tree_add(s, f->time, -f->size);
+	} else {
+		s->cold += weight;
+		f = Malloc(sizeof(struct mrc_file));
+		f->hash = hash;
+		f->next = s->table[hash % MRC_MAX_FILES];
+		s->table[hash % MRC_MAX_FILES] = f;
+		s->nr_files++;
+	}
+	f->size = size;
+	f->time = ++s->time;
+	mrc_tree_add(s, f->time, size);
+	if (s->nr_files > MRC_MAX_FILES && threshold > 1) {
+		mrc_lower_rate(s);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* the stripes added up */
+struct mrc_sum {
+	double hist[MRC_BUCKETS];
+	double cold;
+	double total;
+	long requests;
+	long sampled;
+	unsigned long min_rate, max_rate;	/* 1 in so many files */
 };
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void) 
+static void
+mrc_add_up(struct mrc *m, struct mrc_sum *sum)
 {
-	struct file_data *data;
+	int i, b;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	memset(sum, 0, sizeof(*sum));
+	sum->min_rate = ~0UL;
+	for (i = 0; i < MRC_STRIPES; i++) {
+		struct mrc_stripe *s = &m->stripes[i];
+		unsigned long rate;
+
+		pthread_mutex_lock(&s->lock);
+		for (b = 0; b < MRC_BUCKETS; b++) {
+			sum->hist[b] += s->hist[b];
+		}
+		sum->cold += s->cold;
+		sum->total += s->total;
+		sum->requests += atomic_load(&s->requests);
+		sum->sampled += s->sampled;
+		rate = MRC_MODULUS / atomic_load(&s->threshold);
+		pthread_mutex_unlock(&s->lock);
+		if (rate < sum->min_rate) {
+			sum->min_rate = rate;
+		}
+		if (rate > sum->max_rate) {
+			sum->max_rate = rate;
+		}
+	}
 }
 
-/* free all file data */
-static void 
-file_data_free(struct file_data *data)
+/* estimated miss ratio of an LRU cache of size bytes */
+static double
+mrc_miss_ratio(struct mrc_sum *sum, unsigned long size)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	double misses = sum->cold;
+	int b;
+
+	for (b = MRC_BUCKETS - 1; b >= 0 && mrc_bucket_start(b) > size;
+	     b--) {
+		misses += sum->hist[b];
+	}
+	if (misses > sum->requests) {
+		/* more than we can correct for */
+		return 1;
+	}
+	return sum->requests ? misses / sum->requests : 0;
 }
 
-static void *do_server_thread(void *arg);
+/* print the estimated miss ratio of caches of each power of two bytes that
+ * the distances span, and of max_cache_size if it is set */
+static void
+mrc_print(struct mrc *m, int max_cache_size, FILE *out)
+{
+	struct mrc_sum sum;
+	int b, first = -1, last = -1;
+	unsigned long size;
 
-struct file *cache_lookup(struct server *sv, char *name);
-bool cache_insert(struct server *sv, struct file_data *data);
-bool cache_evict(struct server *sv, int file_size);
+	mrc_add_up(m, &sum);
+	for (b = 0; b < MRC_BUCKETS; b++) {
+		if (sum.hist[b] > 0) {
+			if (first < 0) {
+				first = b;
+			}
+			last = b;
+		}
+	}
+	fprintf(out, "mrc: %ld of %ld requests sampled, 1 in %lu to %lu "
+		"files, %.0f estimated\n", sum.sampled, sum.requests,
+		sum.min_rate, sum.max_rate, sum.total);
+	if (first >= 0) {
+		/* from the power of two below the shortest distance to the
+		 * one above the longest */
+		size = 1;
+		while (size * 2 <= mrc_bucket_start(first)) {
+			size *= 2;
+		}
+		for (; size <= 2 * mrc_bucket_start(last); size *= 2) {
+			fprintf(out, "mrc: %lu bytes, miss ratio %.4f\n", size,
+				mrc_miss_ratio(&sum, size));
+		}
+	}
+	if (max_cache_size > 0) {
+		fprintf(out, "mrc: max_cache_size %d bytes, miss ratio %.4f\n",
+			max_cache_size, mrc_miss_ratio(&sum, max_cache_size));
+	}
+}
 
-unsigned long hashing(struct server *sv, char *string);
-void queue_pop(struct queue *LRU, int idx);
-void LRU_update(struct queue *LRU, int idx);
-void LRU_replace(struct queue *LRU, int idx); 
+static void
+mrc_destroy(struct mrc *m)
+{
+	struct mrc_file *f;
+	int i, j;
 
-void queue_pop(struct queue* LRU, int idx) {
-    struct queue* curr;
-    struct queue* prev; 
+	for (i = 0; i < MRC_STRIPES; i++) {
+		struct mrc_stripe *s = &m->stripes[i];
 
-    if(LRU == NULL || LRU->next == NULL){
- 	return; 			
-    }
-    prev = LRU;
-    curr = LRU->next;
-    
-    if (prev->hash_value == idx){
-        LRU = LRU->next;
-        free(prev);
-        return;
-    }
-    
-    while (curr->hash_value != idx && curr->next != NULL) {
-        prev = curr;
-        curr = curr->next;
-    }
+		for (j = 0; j < MRC_MAX_FILES; j++) {
+			while ((f = s->table[j]) != NULL) {
+				s->table[j] = f->next;
+				free(f);
+			}
+		}
+		free(s->table);
+		free(s->tree);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(m);
+}
 
-    if(curr->hash_value == idx) {
-        prev->next = curr->next;
-        free(curr);
-        curr = NULL;
-        return;
-    }
+/* entries in the stat cache, if it is enabled */
+#define STAT_CACHE_SIZE 4096
+
+/* smallest file size the admission sketch is dimensioned for */
+#define SKETCH_FILE_SIZE 4096
+
+static struct cache *
+cache_init(int max_cache_size, int nr_shards,
+	   const struct server_options *opts)
+{
+	struct cache *cache;
+	const struct cache_policy *policy;
+	int i;
+
+	policy = cache_policy_find(opts->policy);
+	if (policy == NULL) {
+		fprintf(stderr, "unknown cache policy: %s\n", opts->policy);
+		exit(1);
+	}
+	cache = Malloc(sizeof(struct cache));
+	cache->nr_shards = nr_shards;
+	cache->max_cache_size = max_cache_size;
+	atomic_init(&cache->budget, max_cache_size);
+	cache->pressure = NULL;
+	cache->policy = policy;
+	cache->compress = opts->compress;
+	cache->dedup = opts->dedup;
+	cache->bodies = NULL;
+	if (cache->dedup) {
+		cache->bodies = aligned_alloc(CACHE_LINE,
+					      sizeof(struct body_stripe) *
+					      BODY_STRIPES);
+		assert(cache->bodies);
+		for (i = 0; i < BODY_STRIPES; i++) {
+			struct body_stripe *s = &cache->bodies[i];
+
+			pthread_mutex_init(&s->lock, NULL);
+			s->bodies = calloc(BODY_MIN_BUCKETS,
+					   sizeof(struct body *));
+			assert(s->bodies);
+			s->mask = BODY_MIN_BUCKETS - 1;
+			s->nr_bodies = 0;
+			s->body_size = 0;
+			s->shared_size = 0;
+		}
+	}
+	cache->snapshot_loaded = 0;
+	cache->snapshot_stale = 0;
+	cache->watch = NULL;
+	cache->preload = NULL;
+	cache->preload_loaded = 0;
+	cache->preload_skipped = 0;
+	cache->spill = NULL;
+	if (opts->spill_file) {
+		cache->spill = spill_init(opts->spill_file, opts->spill_size);
+	}
+	cache->sketch = NULL;
+	if (opts->admission) {
+		/* enough counters for every file the cache can hold */
+		cache->sketch = sketch_init(max_cache_size / SKETCH_FILE_SIZE);
+	}
+	epoch_init(&cache->epoch);
+	cache->shards = aligned_alloc(CACHE_LINE,
+				      sizeof(struct cache_shard) * nr_shards);
+	assert(cache->shards);
+	for (i = 0; i < nr_shards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->curr_size = 0;
+		shard->data_size = 0;
+		shard->nr_files = 0;
+		/* spread the remainder of the budget over the first shards */
+		atomic_init(&shard->max_size, max_cache_size / nr_shards +
+			    (i < max_cache_size % nr_shards));
+		atomic_init(&shard->index, index_alloc(INDEX_MIN_SIZE));
+		atomic_init(&shard->old_index, NULL);
+		shard->migrate_pos = 0;
+		shard->inflight = NULL;
+		shard->reclaim_need = 0;
+		shard->spill_queue = NULL;
+		atomic_init(&shard->body_charge, 0);
+		atomic_init(&shard->reclaim, false);
+		policy->init(shard);
+	}
+	pthread_mutex_init(&cache->reclaim_lock, NULL);
+	pthread_cond_init(&cache->reclaim_cond, NULL);
+	cache->reclaim_kick = false;
+	cache->reclaim_exiting = false;
+	SYS(pthread_create(&cache->reclaimer, NULL, cache_reclaimer, cache));
+	if (opts->watch) {
+		watch_start(cache);
+	}
+	if (opts->pressure) {
+		pressure_start(cache);
+	}
+	return cache;
 }
 
-unsigned long hashing(struct server *sv, char *string) {
-    unsigned long hash = 5381;
-    int c;
-    
-    while ((c = *string++) != '\0')
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+static void
+cache_destroy(struct cache *cache)
+{
+	int i;
+
+	preload_stop(cache);
+	if (cache->pressure) {
+		pressure_stop(cache);
+	}
+	if (cache->watch) {
+		watch_stop(cache);
+	}
+	pthread_mutex_lock(&cache->reclaim_lock);
+	cache->reclaim_exiting = true;
+	pthread_cond_signal(&cache->reclaim_cond);
+	pthread_mutex_unlock(&cache->reclaim_lock);
+	pthread_join(cache->reclaimer, NULL);
+	pthread_cond_destroy(&cache->reclaim_cond);
+	pthread_mutex_destroy(&cache->reclaim_lock);
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+		struct cache_index *t;
+		unsigned long j;
+
+		/* evicted files the reclaimer did not get to */
+		while (shard->spill_queue) {
+			struct spill_item *item = shard->spill_queue;
+
+			shard->spill_queue = item->next;
+			file_put(cache, item->file);
+			free(item);
+		}
+
+		/* move everything to one table so each file is seen once */
+		index_migrate(cache, shard, ~0UL);
+		t = atomic_load(&shard->index);
+		for (j = 0; j <= t->mask; j++) {
+			struct file *file = atomic_load(&t->slots[j].file);
+
+			if (file == NULL) {
+				continue;
+			}
+			/* all requests are done, so only the cache holds it */
+			assert(atomic_load(&file->refs) == 1);
+			file_free(file);
+		}
+		free(t);
+		cache->policy->destroy(shard);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	/* the bodies went with the last file that used them */
+	for (i = 0; cache->bodies && i < BODY_STRIPES; i++) {
+		free(cache->bodies[i].bodies);
+		pthread_mutex_destroy(&cache->bodies[i].lock);
+	}
+	free(cache->bodies);
+	if (cache->sketch) {
+		sketch_destroy(cache->sketch);
+	}
+	if (cache->spill) {
+		spill_destroy(cache->spill);
+	}
+	epoch_destroy(&cache->epoch);
+	free(cache->shards);
+	free(cache);
+}
+
+static void
+cache_print_stats(struct cache *cache, FILE *out)
+{
+	long size = 0, max_size = 0, nr_files = 0, data_size = 0;
+	long nr_bodies = 0, body_size = 0, shared_size = 0;
+	int i;
+
+	for (i = 0; i < cache->nr_shards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		size += shard_used(shard);
+		data_size += shard->data_size;
+		max_size += shard->max_size;
+		nr_files += shard->nr_files;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	for (i = 0; cache->bodies && i < BODY_STRIPES; i++) {
+		struct body_stripe *s = &cache->bodies[i];
 
-    return hash % HASH_SIZE;
+		pthread_mutex_lock(&s->lock);
+		nr_bodies += s->nr_bodies;
+		body_size += s->body_size;
+		shared_size += s->shared_size;
+		pthread_mutex_unlock(&s->lock);
+	}
+	fprintf(out, "cache: %ld files, %ld of %ld bytes\n", nr_files, size,
+		max_size);
+	/* more than the budget if compression pays off */
+	fprintf(out, "cache: %ld bytes of files cached, %.2f of budget\n",
+		data_size, max_size ? (double)data_size / max_size : 0);
+	if (cache->dedup) {
+		/* bytes the files' bodies add up to, per byte stored */
+		fprintf(out, "dedup: %ld bodies, %ld bytes for %ld bytes of "
+			"files, ratio %.2f\n", nr_bodies, body_size,
+			shared_size,
+			body_size ? (double)shared_size / body_size : 1);
+	}
+	if (cache->preload_loaded || cache->preload_skipped) {
+		fprintf(out, "preload: %ld files loaded, %ld skipped\n",
+			cache->preload_loaded, cache->preload_skipped);
+	}
+	if (cache->snapshot_loaded || cache->snapshot_stale) {
+		fprintf(out, "snapshot: %ld files loaded, %ld stale\n",
+			cache->snapshot_loaded, cache->snapshot_stale);
+	}
+	if (cache->watch) {
+		watch_print_stats(cache->watch, out);
+	}
+	if (cache->pressure) {
+		pressure_print_stats(cache, out);
+	}
+	if (cache->spill) {
+		spill_print_stats(cache->spill, out);
+	}
+	if (slab_enabled) {
+		slab_print_stats(out);
+	}
 }
 
-struct file *cache_lookup(struct server *sv, char *name){
-    struct file *target;
-    int i = hashing(sv, name); 
-        
-    if (sv->web_cache->hashtable == NULL){
-        return NULL;
-    }
-    while (sv->web_cache->hashtable[i] != NULL){
-        target = sv->web_cache->hashtable[i];
-        if (strcmp(target->name, name) == 0){
-            return target;
-        } 
-        i+=1;
-        i = i % HASH_SIZE;
-    }
+/* the cache snapshot. on exit the cached files are saved to a snapshot file,
+ * and on startup the ones that have not changed since are loaded back, so
+ * that a restarted server starts warm. the snapshot is a magic string and
+ * then, for each file, a record followed by the file's name and its decoded
+ * body. only the server that wrote it reads it, so it is in native byte
+ * order. */
+#define SNAPSHOT_MAGIC "wsnap01\n"
+
+struct snapshot_record {
+	long long mtime_sec;	/* of the file when it was read */
+	long long mtime_nsec;
+	int name_size;		/* including the NUL */
+	int size;
+	unsigned int csum;
+};
+
+static bool
+snapshot_write(FILE *f, struct file *file)
+{
+	struct file_data *data = file->data;
+	struct snapshot_record r;
+	char *body = data->file_buf;
 
-    return NULL;
+	if (data->file_zbuf) {
+		body = lz_buffer(data->file_size);
+		lz_decompress((unsigned char *)data->file_zbuf,
+			      data->file_zsize, (unsigned char *)body,
+			      data->file_size);
+	}
+	memset(&r, 0, sizeof(r));
+	r.mtime_sec = data->file_mtime.tv_sec;
+	r.mtime_nsec = data->file_mtime.tv_nsec;
+	r.name_size = strlen(file->name) + 1;
+	r.size = data->file_size;
+	r.csum = data->file_csum;
+	return fwrite(&r, sizeof(r), 1, f) == 1 &&
+		fwrite(file->name, r.name_size, 1, f) == 1 &&
+		(r.size == 0 || fwrite(body, r.size, 1, f) == 1);
 }
 
-bool cache_insert(struct server *sv, struct file_data *data){
-    if (cache_lookup(sv, data->file_name) != NULL){
-        return true; 
-    }
-    else if (cache_evict(sv, data->file_size)){ 
-        struct file *new_file;
-        unsigned long i = hashing(sv, data->file_name);
+/* save the cached files to path. the snapshot is written next to it and
+ * renamed over it, so path always holds a complete snapshot. */
+static void
+snapshot_save(struct cache *cache, const char *path)
+{
+	char tmp[MAXLINE];
+	FILE *f;
+	bool ok;
+	int i;
 
-        if (sv->web_cache->hashtable == NULL){
-            return false;
-        }
-        while(sv->web_cache->hashtable[i] != NULL){
-            if (strcmp(sv->web_cache->hashtable[i]->name, data->file_name) == 0){
-                break;
-            }
-            i += 1;
-            i = i % HASH_SIZE;
-        }
-        new_file = (struct file*)malloc(sizeof(struct file));
-
-        new_file->name = (char *)malloc(sizeof(char) * (strlen(data->file_name) + 1));
-        strcpy(new_file->name, data->file_name);
-        new_file->name[strlen(data->file_name)] = '\0';
-        new_file->data = data;
-        sv->web_cache->hashtable[i] = new_file;
-        sv->web_cache->curr_size += data->file_size;
-        LRU_update(sv->web_cache->LRU, i);
-        return true;  
-    }
-    return false;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "snapshot %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	ok = fwrite(SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC), 1, f) == 1;
+	for (i = 0; ok && i < cache->nr_shards; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+		struct cache_index *t;
+		unsigned long j;
+
+		pthread_mutex_lock(&shard->lock);
+		/* move everything to one table so each file is seen once */
+		index_migrate(cache, shard, ~0UL);
+		t = atomic_load(&shard->index);
+		for (j = 0; ok && j <= t->mask; j++) {
+			struct file *file = atomic_load(&t->slots[j].file);
+
+			if (file != NULL) {
+				ok = snapshot_write(f, file);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	lz_buffer_free();
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (ok && rename(tmp, path) == 0) {
+		return;
+	}
+	fprintf(stderr, "snapshot %s: %s\n", path, strerror(errno));
+	unlink(tmp);
 }
 
-bool cache_evict(struct server *sv, int file_size){
-    if (file_size <= sv->web_cache->max_size - sv->web_cache->curr_size){
-        return true; 
-    }
-    else if (file_size > sv->web_cache->max_size){
-        return false; 
-    }
-    else{
-        
-        struct cache *cache = sv->web_cache;
-        struct queue *curr = cache->LRU;
-
-        while(curr != NULL && (cache->max_size - cache->curr_size) < file_size) {
-            struct file *file = cache->hashtable[curr->hash_value];
-            if(file != NULL){
-                cache->curr_size -= file->data->file_size;
-                file_data_free(cache->hashtable[curr->hash_value]->data);
-                free(cache->hashtable[curr->hash_value]->name);
-                cache->hashtable[curr->hash_value] = NULL;
-                queue_pop(cache->LRU, curr->hash_value);
-            }
-            curr = curr->next;
-        }	
-        if ((cache->max_size - cache->curr_size) >= file_size){
-            return true;
-        }
-        else{
-            return false;
-        }
-    }
+/* is the file that r was saved from unchanged? */
+static bool
+snapshot_fresh(const char *name, struct snapshot_record *r)
+{
+	struct stat sbuf;
+
+	return stat(name, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+		sbuf.st_size == r->size &&
+		sbuf.st_mtim.tv_sec == r->mtime_sec &&
+		sbuf.st_mtim.tv_nsec == r->mtime_nsec;
 }
 
-void LRU_update(struct queue *LRU, int idx){
-    struct queue *last;
-    struct queue *new = (struct queue*)malloc(sizeof(struct queue));
-    new->hash_value = idx;
-    new->next = NULL;
+/* cache a file saved in a snapshot, as a miss would have. returns true if
+ * there was room for it. */
+static bool
+snapshot_add(struct cache *cache, const char *name, const char *body,
+	     struct snapshot_record *r)
+{
+	struct file_data *data = file_data_init();
+	struct cache_shard *shard;
+	struct file *file;
+	unsigned long hash;
+	bool cached;
 
-    if(LRU->next == NULL) {
-        LRU->next = new;
-        return;
-    }
-    last = LRU->next; 
-    while(last->next != NULL) {
-        last = last->next;
-    }
-    last->next = new;
+	data->file_name = strdup(name);
+	assert(data->file_name);
+	data->file_size = r->size;
+	data->file_mtime.tv_sec = r->mtime_sec;
+	data->file_mtime.tv_nsec = r->mtime_nsec;
+	if (r->size > 0) {
+		/* freed like a buffer that request_readfile() read into */
+		data->file_buf = slab_alloc(r->size);
+		memcpy(data->file_buf, body, r->size);
+	}
+	request_prepare_checked(data, r->csum);
+	if (cache->compress) {
+		file_data_compress(data);
+	}
+	hash = hashing(data->file_name);
+	shard = cache_shard(cache, hash);
+	file = file_new(hash, data,
+			cache->dedup ? body_get(cache, data) : NULL);
+	pthread_mutex_lock(&shard->lock);
+	cached = cache_insert(cache, shard, file);
+	pthread_mutex_unlock(&shard->lock);
+	file_put(cache, file);
+	file_data_free(data);
+	return cached;
+}
+
+/* load the files saved in the snapshot at path, if there is one, with a
+ * sequential pass over a mapping of it */
+static void
+snapshot_load(struct cache *cache, const char *path)
+{
+	size_t magic_size = strlen(SNAPSHOT_MAGIC);
+	struct snapshot_record r;
+	struct stat sbuf;
+	char *map, *p, *end;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		/* nothing was saved yet */
+		return;
+	}
+	SYS(fstat(fd, &sbuf));
+	if (sbuf.st_size < (off_t)magic_size) {
+		SYS(close(fd));
+		fprintf(stderr, "snapshot %s: not a snapshot\n", path);
+		return;
+	}
+	map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	SYS(map == MAP_FAILED ? -1 : 0);
+	SYS(close(fd));
+	SYS(madvise(map, sbuf.st_size, MADV_SEQUENTIAL));
+	p = map;
+	end = map + sbuf.st_size;
+	if (memcmp(p, SNAPSHOT_MAGIC, magic_size) != 0) {
+		fprintf(stderr, "snapshot %s: not a snapshot\n", path);
+		goto out;
+	}
+	p += magic_size;
+	while (p < end) {
+		char *name, *body;
+
+		if (end - p < (long)sizeof(r)) {
+			break;
+		}
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+		if (r.name_size <= 0 || r.size < 0 ||
+		    end - p < (long)r.name_size + r.size ||
+		    p[r.name_size - 1] != 0) {
+			break;
+		}
+		name = p;
+		body = p + r.name_size;
+		p = body + r.size;
+		if ((cache->watch && !watch_file(cache->watch, name)) ||
+		    !snapshot_fresh(name, &r)) {
+			cache->snapshot_stale++;
+		} else if (snapshot_add(cache, name, body, &r)) {
+			cache->snapshot_loaded++;
+		}
+	}
+	if (p < end) {
+		fprintf(stderr, "snapshot %s: truncated\n", path);
+	}
+out:
+	SYS(munmap(map, sbuf.st_size));
 }
 
-void LRU_replace(struct queue *LRU, int idx){
-    queue_pop(LRU, idx);
-    LRU_update(LRU, idx);
+/* send a file pinned by the caller. a compressed file is sent as is if the
+ * client accepts that, else it is decompressed into this thread's buffer. */
+static void
+file_send(struct request *rq, struct file *file)
+{
+	struct file_data tmp;
+
+	if (file->data->file_mapped) {
+		/* stop if the file is invalidated while we send it */
+		request_set_data(rq, file->data);
+		request_sendmapped(rq, &file->changed);
+		return;
+	}
+	if (file->data->file_zbuf == NULL) {
+		request_set_data(rq, file->data);
+		request_sendfile(rq);
+		return;
+	}
+	tmp = *file->data;
+	if (request_accepts_encoding(rq, LZ_CODING)) {
+		tmp.file_buf = tmp.file_zbuf;
+		tmp.file_size = tmp.file_zsize;
+		tmp.header = tmp.zheader;
+		tmp.header_size = tmp.zheader_size;
+	} else {
+		int size = file->data->file_size;
+
+		tmp.file_buf = lz_buffer(size);
+		size = lz_decompress((unsigned char *)tmp.file_zbuf,
+				     tmp.file_zsize,
+				     (unsigned char *)tmp.file_buf, size);
+		assert(size == file->data->file_size);
+	}
+	request_set_data(rq, &tmp);
+	request_sendfile(rq);
 }
- 
-static void do_server_request(struct server *sv, int connfd) 
+
+static void
+do_server_request(struct server *sv, int connfd)
 {
-    int ret;
-    struct request *rq;
-    struct file_data *data;
+	int ret;
+	struct request *rq;
+	struct file_data *data;
+	struct cache_shard *shard;
+	struct file *target;
+	struct inflight *fl;
+	unsigned long hash;
+	bool watched;
 
-    data = file_data_init();
+	data = file_data_init();
 
-    /* fill data->file_name with name of the file being requested */
-    rq = request_init(connfd, data);
-    if (!rq) {
-        file_data_free(data);
-        return;
-    }
+	/* fill data->file_name with name of the file being requested */
+	rq = request_init(connfd, data);
+	if (!rq) {
+		file_data_free(data);
+		return;
+	}
 
-    if(sv->max_cache_size > 0){
-        pthread_mutex_lock(&lock);
-        struct file *target = cache_lookup(sv, data->file_name); 		
-        if (target != NULL){ 
-            data = target->data; 
-            request_set_data(rq, data); 
-            LRU_replace(sv->web_cache->LRU, hashing(sv, data->file_name));
-        }
-        else{ 
-            pthread_mutex_unlock(&lock);
-            ret = request_readfile(rq);
-            if (ret == 0){
-                goto out;
-            }
-            pthread_mutex_lock(&lock);
-            if (cache_insert(sv, data)){
-                LRU_replace(sv->web_cache->LRU, hashing(sv, data->file_name));
-            }
-        }
-        pthread_mutex_unlock(&lock);
-        request_sendfile(rq);
-    }
-    else {
-        ret = request_readfile(rq);
-        if (ret == 0) { /* couldn't read file */
-            goto out;
-        }
-        /* send file to client */
-        request_sendfile(rq);
-    }
+	if (sv->max_cache_size == 0) {
+		ret = sv->zero_copy ? request_openfile(rq, 0) : -1;
+		if (ret < 0) { /* no zero-copy, read it in */
+			ret = request_readfile(rq);
+		}
+		if (ret == 0) { /* couldn't read file */
+			goto out;
+		}
+		if (sv->mrc) {
+			mrc_access(sv->mrc, hashing(data->file_name),
+				   data->file_size);
+		}
+		/* send file to client */
+		request_sendfile(rq);
+		goto out;
+	}
+
+	hash = hashing(data->file_name);
+	shard = cache_shard(sv->web_cache, hash);
+	if (sv->web_cache->sketch) {
+		sketch_add(sv->web_cache->sketch, hash);
+	}
+
+	/* cache hits take no lock. the epoch only protects the lookup, the
+	 * file is pinned while we send it so eviction cannot free it. */
+	epoch_enter(&sv->web_cache->epoch);
+	target = cache_lookup(shard, hash, data->file_name);
+	if (target != NULL && !file_get(target)) {
+		target = NULL;
+	}
+	epoch_exit(&sv->web_cache->epoch);
+	if (target != NULL && file_changed(target)) {
+		/* invalidated since we found it, read the file again */
+		file_put(sv->web_cache, target);
+		target = NULL;
+	}
+	if (target != NULL) {
+		cache_hit(sv->web_cache, shard, target);
+		goto send;
+	}
+
+	/* files too big to ever be cached are sent straight from disk */
+	if (sv->zero_copy) {
+		/* the budget may be changing under us */
+		ret = request_openfile(rq, atomic_load_explicit(
+					       &shard->max_size,
+					       memory_order_relaxed) + 1);
+		if (ret >= 0) {
+			if (ret) {
+				if (sv->mrc) {
+					mrc_access(sv->mrc, hash,
+						   data->file_size);
+				}
+				request_sendfile(rq);
+			}
+			goto out;
+		}
+	}
+
+	/* a concurrent resize or delete can hide a file from a lock-free
+	 * probe, so check again before going to disk */
+	pthread_mutex_lock(&shard->lock);
+	target = cache_lookup(shard, hash, data->file_name);
+	if (target != NULL && file_get(target)) {
+		pthread_mutex_unlock(&shard->lock);
+		cache_hit(sv->web_cache, shard, target);
+		goto send;
+	}
+	/* if another request is already reading the file, share its result */
+	fl = inflight_find(shard, hash, data->file_name);
+	if (fl != NULL) {
+		target = inflight_wait(shard, fl);
+		pthread_mutex_unlock(&shard->lock);
+		if (target != NULL && file_changed(target)) {
+			file_put(sv->web_cache, target);
+			target = NULL;
+		}
+		if (target != NULL) {
+			goto send;
+		}
+		/* the load failed or the file changed since, so read it
+		 * ourselves */
+		if (request_readfile(rq)) {
+			request_sendfile(rq);
+		}
+		goto out;
+	}
+	fl = inflight_start(shard, hash, data->file_name);
+	pthread_mutex_unlock(&shard->lock);
+	/* a file that can not be watched for changes is not cached */
+	watched = sv->web_cache->watch == NULL ||
+		watch_file(sv->web_cache->watch, data->file_name);
+
+	ret = 0;
+	if (sv->web_cache->spill) {
+		ret = spill_read(sv->web_cache->spill, rq, data, hash);
+	}
+	if (ret) {
+		/* found a copy in the spill tier */
+	} else if (sv->mmap_cache) {
+		ret = request_mapfile(rq);
+	} else {
+		ret = request_readfile(rq);
+	}
+	if (ret == 0) {
+		pthread_mutex_lock(&shard->lock);
+		inflight_finish(shard, fl, NULL);
+		pthread_mutex_unlock(&shard->lock);
+		goto out;
+	}
+	/* the file is shared from now on, so build its response now */
+	request_prepare_data(data);
+	if (sv->web_cache->compress) {
+		file_data_compress(data);
+	}
+	/* a mapping shows later changes to its own file, so it is not
+	 * shared with other files */
+	target = file_new(hash, data, sv->web_cache->dedup &&
+			  !data->file_mapped ? body_get(sv->web_cache, data) :
+			  NULL);
+	pthread_mutex_lock(&shard->lock);
+	/* if it is not cached, it is still shared with the waiters */
+	if (watched && !fl->stale) {
+		cache_insert(sv->web_cache, shard, target);
+	}
+	inflight_finish(shard, fl, target);
+	pthread_mutex_unlock(&shard->lock);
+send:
+	if (sv->mrc) {
+		mrc_access(sv->mrc, hash, target->data->file_size);
+	}
+	/* serve the shared copy, our own data is no longer needed */
+	if (data) {
+		file_data_free(data);
+		data = NULL;
+	}
+	file_send(rq, target);
+	file_put(sv->web_cache, target);
 out:
-    request_destroy(rq);
-    //file_data_free(data);
-} 
+	if (data) {
+		file_data_free(data);
+	}
+	request_destroy(rq);
+}
 
+void
+server_options_init(struct server_options *opts)
+{
+	opts->nr_shards = 0;
+	opts->policy = "clock";
+	opts->admission = 0;
+	opts->zero_copy = 0;
+	opts->mmap_cache = 0;
+	opts->slab = 0;
+	opts->huge_pages = 0;
+	opts->compress = 0;
+	opts->dedup = 0;
+	opts->snapshot = NULL;
+	opts->preload = NULL;
+	opts->watch = 0;
+	opts->stat_ttl = 0;
+	opts->fd_cache = 0;
+	opts->pressure = 0;
+	opts->mrc = 0;
+	opts->spill_file = NULL;
+	opts->spill_size = 0;
+	opts->stats = 0;
+}
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(int nr_threads, int max_requests, int max_cache_size,
+	    const struct server_options *opts)
 {
 	struct server *sv;
+	int nr_shards = opts->nr_shards;
 	int i;
 
 	sv = Malloc(sizeof(struct server));
@@ -282,6 +5284,10 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	/* we add 1 because we queue at most max_request - 1 requests */
 	sv->max_requests = max_requests + 1;
 	sv->max_cache_size = max_cache_size;
+	sv->zero_copy = opts->zero_copy;
+	sv->mmap_cache = opts->mmap_cache;
+	sv->stats = opts->stats;
+	sv->snapshot = opts->snapshot;
 	sv->exiting = 0;
 
 	/* Lab 4: create queue of max_request size when max_requests > 0 */
@@ -292,7 +5298,39 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	sv->request_head = 0;
 	sv->request_tail = 0;
 
-	/* Lab 5: init server cache and limit its size to max_cache_size */
+	/* Lab 5: init server cache and limit its size to max_cache_size.
+	 * by default use one shard per worker thread, but never give a shard
+	 * less than a byte of budget. */
+	if (nr_shards <= 0) {
+		nr_shards = nr_threads > 0 ? nr_threads : 1;
+	}
+	if (max_cache_size > 0 && nr_shards > max_cache_size) {
+		nr_shards = max_cache_size;
+	}
+	sv->nr_shards = nr_shards;
+	sv->web_cache = NULL;
+	sv->mrc = opts->mrc ? mrc_init() : NULL;
+	if (opts->stat_ttl > 0) {
+		request_set_stat_cache(STAT_CACHE_SIZE, opts->stat_ttl);
+	}
+	if (opts->fd_cache > 0) {
+		request_set_fd_cache(opts->fd_cache);
+	}
+	if (max_cache_size > 0 && (opts->slab || opts->huge_pages)) {
+		slab_init(opts->huge_pages);
+		request_set_allocator(slab_alloc, slab_free);
+	}
+	if (max_cache_size > 0) {
+		sv->web_cache = cache_init(max_cache_size, nr_shards, opts);
+		if (sv->snapshot) {
+			snapshot_load(sv->web_cache, sv->snapshot);
+		}
+		if (opts->preload) {
+			/* as many loaders as workers, running alongside */
+			preload_start(sv->web_cache, opts->preload,
+				      nr_threads);
+		}
+	}
 
 	/* Lab 4: create worker threads when nr_threads > 0 */
 	pthread_mutex_init(&sv->mutex, NULL);
@@ -302,19 +5340,6 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	for (i = 0; i < nr_threads; i++) {
             SYS(pthread_create(&(sv->threads[i]), NULL, do_server_thread, (void *)sv));
 	}
-        if (max_cache_size > 0) {
-            sv->web_cache = (struct cache *)malloc(sizeof(struct cache));
-            sv->web_cache->LRU = (struct queue *)malloc(sizeof(struct queue));
-            HASH_SIZE = max_cache_size;
-            sv->web_cache->hashtable_size = HASH_SIZE;
-            sv->web_cache->hashtable = (struct file**)malloc(HASH_SIZE * sizeof(struct file*));
-            sv->web_cache->curr_size = 0;
-            sv->web_cache->max_size = max_cache_size;
-            sv->web_cache->LRU->next = NULL;
-            for(int i = 0; i < HASH_SIZE; i++) {
-                sv->web_cache->hashtable[i] = NULL;
-            }
-        }
 	return sv;
 }
 
@@ -346,6 +5371,7 @@ do_server_thread(void *arg)
 		do_server_request(sv, connfd);
 	}
 out:
+	lz_buffer_free();
 	return NULL;
 }
 
@@ -385,24 +5411,24 @@ void server_exit(struct server *sv) {
     free(sv->conn_buf);
     free(sv->threads);
     
-    struct queue* prev = sv->web_cache->LRU;
-    struct queue* curr;  
-
-    while (prev != NULL){  
-        curr = prev->next;  
-        free(prev);  
-        prev = curr;  
-    }  
-    
-    for(int i = 0; i < HASH_SIZE; i++){
-        if(sv->web_cache->hashtable[i] != NULL){
-            file_data_free(sv->web_cache->hashtable[i]->data);
-            free(sv->web_cache->hashtable[i]->name);
-            sv->web_cache->hashtable[i] = NULL;
+    if (sv->web_cache) {
+        preload_stop(sv->web_cache);
+        if (sv->snapshot) {
+            snapshot_save(sv->web_cache, sv->snapshot);
+        }
+        if (sv->stats) {
+            cache_print_stats(sv->web_cache, stderr);
         }
+        cache_destroy(sv->web_cache);
+    }
+    if (sv->stats) {
+        request_print_stat_stats(stderr);
+        request_print_fd_stats(stderr);
+    }
+    if (sv->mrc) {
+        mrc_print(sv->mrc, sv->max_cache_size, stderr);
+        mrc_destroy(sv->mrc);
     }
-    free(sv->web_cache->hashtable);
-    free(sv->web_cache);
     free(sv);
     return; 
 }
@@ -3,8 +3,33 @@
 
 struct server;
 
+/* optional server settings. server_options_init() sets the defaults. */
+struct server_options {
+	int nr_shards;		/* cache shards, 0 for one per worker thread */
+	const char *policy;	/* cache replacement policy */
+	int admission;		/* filter cache inserts with TinyLFU */
+	int zero_copy;		/* sendfile(2) files the cache cannot hold */
+	int mmap_cache;		/* cache mmaps of files instead of copies */
+	int slab;		/* allocate cache memory from size-class slabs */
+	int huge_pages;		/* slabs, backed by huge pages if possible */
+	int compress;		/* keep compressible files compressed */
+	int dedup;		/* share the bodies of identical files */
+	const char *spill_file;	/* spill tier file, or NULL for none */
+	long spill_size;	/* bytes to preallocate for it */
+	const char *snapshot;	/* cache snapshot file, or NULL for none */
+	const char *preload;	/* fileset index to preload, or NULL */
+	int watch;		/* drop cached files when they change */
+	long stat_ttl;		/* ms to cache stat results for, 0 for none */
+	int fd_cache;		/* files to keep open, 0 for none */
+	int pressure;		/* shrink the cache when memory is short */
+	int mrc;		/* estimate and print the miss ratio curve */
+	int stats;		/* print cache statistics on exit */
+};
+
+void server_options_init(struct server_options *opts);
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+			   int max_cache_size,
+			   const struct server_options *opts);
 void server_request(struct server *sv, int connfd);
 void server_exit(struct server *sv);
 